@@ -1,8 +1,21 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <getopt.h>
+#include <limits.h>
 #include <math.h>
 #include <omp.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -17,7 +30,32 @@
 #define IMG_CHANNEL_NUM   3
 #define PI                3.14159
 #define MAX_SYMBOL_LEN    10
-#define DEPTH_THRESHOLD   4
+#define ARENA_SIZE        (1 << 16)
+#define BUILD_FORK_DEPTH  10
+#define TILE_WIDTH        64
+#define CULL_TILE_SIZE    64
+#define CULL_MIN_SIZE     4
+#define ADAPTIVE_CELL     32
+#define ADAPTIVE_THRESHOLD 4
+#define PROGRESSIVE_STEP  8
+#define TILED_MIN_SIZE    4
+#define TILED_MAX_SIZE    64
+#define CONTRACT_MIN_LANES 64
+#define TASK_TILE         64
+#define TASK_GRAIN        (1 << 18)
+#define WAVEFRONT_STRIP   (1 << 16)
+#define WAVEFRONT_BLOCK   1024
+#define STEAL_DEQUE_SIZE  (1 << 16)
+#define STEAL_MAX_SIDE    0xffff
+#define AUTO_ROWS         32
+#define AUTO_CACHE_FILE   ".rart-autotune"
+#define AOT_CC            "gcc -O3 -march=native -ffp-contract=off -shared -fPIC"
+
+#define USAGE \
+    "Usage: %s GRAMMAR_FILE [-o OUTPUT_FILE] [-w WIDTH] [-h HEIGHT] [-d DEPTH] [-t NUM_THREADS] " \
+    "[-e ENGINE] [-s SEED] [--seed-string STRING] [-c] [-p] [-r] [--emit-c C_FILE] [--aot] [--no-opt] [--fast-math] [--float] " \
+    "[--threshold N] [--dump-passes PREFIX] [--tile N] [--steal] [--numa] [--pin compact|scatter] [--auto] " \
+    "[--layout build|dfs|veb] [--layout-bench]\n"
 
 enum {
     X,
@@ -25,12 +63,66 @@ enum {
     RAND_NUM,
 };
 
+/* Opcodes; must follow the order of func_collection */
+enum {
+    OP_GET_X,
+    OP_GET_Y,
+    OP_RAND,
+    OP_ID,
+    OP_SIN,
+    OP_TAN,
+    OP_NEG,
+    OP_SQRT,
+    OP_ADD,
+    OP_MULT,
+    OP_MIX,
+    OP_EIGHT_SUM,
+    OP_STORE,           /* fused programs only; not in func_collection */
+};
+
+enum {
+    ENGINE_TREE,
+    ENGINE_BYTECODE,
+    ENGINE_SIMD,
+    ENGINE_JIT,
+    ENGINE_AOT,
+    ENGINE_DAG,
+    ENGINE_HOIST,
+    ENGINE_FUSED,
+    ENGINE_CULL,
+    ENGINE_ADAPTIVE,
+    ENGINE_PROGRESSIVE,
+    ENGINE_TILED,
+    ENGINE_TASKS,
+    ENGINE_WAVEFRONT,
+};
+
+/* Long-only command line options */
+enum {
+    OPT_EMIT_C = 256,
+    OPT_AOT,
+    OPT_NO_OPT,
+    OPT_FAST_MATH,
+    OPT_FLOAT,
+    OPT_THRESHOLD,
+    OPT_DUMP_PASSES,
+    OPT_TILE,
+    OPT_STEAL,
+    OPT_NUMA,
+    OPT_PIN,
+    OPT_AUTO,
+    OPT_LAYOUT,
+    OPT_LAYOUT_BENCH,
+    OPT_SEED_STRING,
+};
+
 typedef double (*Func)(double[MAX_ARG_NUM]);
 
 typedef struct FuncInfo {
     Func func;
     int arity;
     char func_name[32];
+    int op;
 } FuncInfo;
 
 typedef struct SubRule {
@@ -42,31 +134,335 @@ typedef struct SubRule {
 typedef struct Rule {
     int func_num;
     SubRule sub_rules[MAX_FUNC_NUM];
+    float alias_prob[MAX_FUNC_NUM];     /* Walker alias table, see build_alias_table */
+    int alias[MAX_FUNC_NUM];
 } Rule;
 
+/*
+ * A tree node sized to its arity. Arguments are byte offsets from the node
+ * itself, so a tree stays valid when its arena grows or is copied.
+ */
 typedef struct ExpressionNode {
-    FuncInfo func_info;
-    struct ExpressionNode *args[MAX_ARG_NUM];
     double rand_num;
+    unsigned char op;
+    unsigned char arity;
+    int args[];
 } ExpressionNode;
 
+/* xoshiro256** state; each builder owns one, so no lock is shared */
+typedef struct Rng {
+    uint64_t s[4];
+} Rng;
+
+/* One growable block holding the nodes of a set of trees, freed at once */
+typedef struct Arena {
+    char *base;
+    size_t len;
+    size_t size;
+} Arena;
+
+/* A subtree below BUILD_FORK_DEPTH, built by one thread from its own stream */
+typedef struct BuildTask {
+    int pos;
+    int depth;
+    Rng rng;
+    int parent;         /* offset of the node above in the upper arena, or -1 for a root */
+    int arg;            /* argument of the parent, or channel of a root */
+    int thread;         /* arena the subtree was built in */
+    int offset;         /* where the subtree starts in that arena, and in the result */
+    int len;
+} BuildTask;
+
+typedef struct TreeBuilder {
+    Rule *grammar;
+    Arena upper;        /* nodes from BUILD_FORK_DEPTH up */
+    BuildTask *tasks;
+    int tasks_cnt;
+    int tasks_size;
+} TreeBuilder;
+
+/* One postfix instruction; imm holds the constant of RAND */
+typedef struct Instruction {
+    int op;
+    double imm;
+} Instruction;
+
+typedef struct Program {
+    Instruction *code;
+    int len;
+    int stack_size;
+} Program;
+
+/* A node of the hash-consed graph; its arguments are args[first_arg...] */
+typedef struct DagNode {
+    int op;
+    int arity;
+    int first_arg;
+    double imm;
+} DagNode;
+
+/*
+ * The three channel trees merged into one graph in which every distinct
+ * subexpression appears once. Nodes are topologically ordered, so the
+ * arguments of a node always precede it.
+ */
+typedef struct Dag {
+    DagNode *nodes;
+    int *args;
+    int len;
+    int args_len;
+    int roots[3];
+} Dag;
+
+/* Which of the coordinates a DAG node depends on */
+enum {
+    DEP_CONST = 0,
+    DEP_X = 1,
+    DEP_Y = 2,
+    DEP_MIXED = DEP_X | DEP_Y,
+};
+
+typedef struct HoistPlan {
+    int *nodes[4];          /* DAG nodes by DEP_* tag, in topological order */
+    int nodes_len[4];
+    int *x_frontier;
+    int x_frontier_len;
+    int *y_frontier;
+    int y_frontier_len;
+} HoistPlan;
+
+/*
+ * DAG nodes grouped by level (leaves are level 0) with a buffer slot each;
+ * a slot is reused by a later level once all consumers of its node are done
+ */
+typedef struct WavefrontPlan {
+    int *order;             /* nodes sorted by level */
+    int *level_start;       /* levels + 1 offsets into order */
+    int levels;
+    int *slot;
+    int slots_cnt;
+} WavefrontPlan;
+
+typedef struct Interval {
+    double lo;
+    double hi;
+} Interval;
+
+/* Called by the progressive renderer after each pass with a complete preview */
+typedef void (*PassCallback)(unsigned char *img, int width, int height, int pass, int step, void *data);
+
+typedef struct PassReport {
+    double tstart;
+    char *prefix;
+} PassReport;
+
+typedef void (*JitFunc)(double x, double y, double out[3]);
+
+typedef void (*AotFillFunc)(unsigned char *img, int width, int height, int row_begin, int row_end);
+
+/* A renderer generated as C, compiled by the system compiler and dlopen'ed */
+typedef struct AotCode {
+    void *handle;
+    AotFillFunc fill;
+} AotCode;
+
+/*
+ * Chase-Lev work-stealing deque of one worker: the owner pushes and takes
+ * at the bottom, thieves steal at the top. The counters are only written
+ * by the owner and the deques are cache line aligned.
+ */
+typedef struct StealDeque {
+    _Alignas(64) atomic_long top;
+    _Alignas(64) atomic_long bottom;
+    _Atomic long *items;
+    long executed;
+    long steals;
+    long idle;
+} StealDeque;
+
+typedef struct StealPool StealPool;
 
-ExpressionNode *build_expression_tree(Rule *grammar, int pos, int depth);
+typedef void (*StealFunc)(StealPool *pool, int worker, long task, void *data);
+
+/* Tasks are longs interpreted by run; pending counts the unfinished ones */
+struct StealPool {
+    StealDeque *deques;
+    int workers_cnt;
+    atomic_long pending;
+    StealFunc run;
+    void *data;
+};
+
+/* Orders in which relayout_expression_trees places the nodes */
+enum {
+    LAYOUT_BUILD,       /* leave the arena as built and optimized */
+    LAYOUT_DFS,         /* pre-order, the order evaluate_expression_tree visits */
+    LAYOUT_VEB,         /* van Emde Boas: top half of the levels, then each subtree below */
+    LAYOUT_SCATTER,     /* random order, like nodes malloc'd from a fragmented heap */
+};
+
+char *layout_names[] = {
+    "build",
+    "dfs",
+    "veb",
+    "scatter",
+};
+
+enum {
+    PIN_NONE,
+    PIN_COMPACT,        /* thread t on the t-th allowed CPU */
+    PIN_SCATTER,        /* threads dealt round-robin over the packages */
+};
+
+/* Loop shapes of the renderers, which first_touch_image reproduces */
+enum {
+    TOUCH_PIXELS,       /* collapse(2) schedule(runtime) over rows and pixels */
+    TOUCH_SEGMENTS,     /* collapse(2) schedule(runtime) over rows and TILE_WIDTH segments */
+    TOUCH_ROWS,         /* static split of the rows */
+};
+
+/*
+ * Where the threads of the team run and the copies of the trees and
+ * programs made on each NUMA node; disabled while nodes_cnt is 0
+ */
+typedef struct NumaLayout {
+    int nodes_cnt;
+    int threads_cnt;
+    int *thread_cpu;
+    int *thread_node;
+    long *thread_touched;   /* image pixels first touched by each thread */
+    long *thread_pixels;    /* pixels rendered and busy time of each thread */
+    double *thread_time;
+    ExpressionNode *trees_src[3];
+    ExpressionNode *(*trees)[3];
+    char **tree_blocks;
+    Program *progs_src;
+    Program (*progs)[3];
+} NumaLayout;
+
+/* A configuration tried by the autotuner; sched is an omp_sched_t */
+typedef struct AutoConfig {
+    int engine;
+    int sched;
+    int chunk;
+    int tile;
+    int threads_cnt;
+} AutoConfig;
+
+/* Native code for the three channels in an executable mapping */
+typedef struct JitCode {
+    unsigned char *buf;
+    size_t size;
+    size_t len;
+    JitFunc func;
+} JitCode;
+
+void init_arena(Arena *arena, size_t size);
+int arena_alloc(Arena *arena, size_t bytes);
+void free_arena(Arena *arena);
+ExpressionNode *expression_arg(ExpressionNode *node, int i);
+void set_expression_arg(ExpressionNode *node, int i, ExpressionNode *arg);
+size_t expression_node_size(int arity);
+void seed_rng(Rng *rng, uint64_t seed);
+void seed_rng_string(Rng *rng, const char *str);
+uint64_t next_rng(Rng *rng);
+double rng_uniform(Rng *rng);
+void sha256(const unsigned char *data, size_t len, unsigned char digest[32]);
+int build_expression_tree(Arena *arena, Rule *grammar, int pos, int depth, Rng *rng);
+void build_expression_forest(Arena *arena, Rule *grammar, int entry_symbol_arr[3], int depth,
+        Rng *rng, int threads_cnt, int offsets[3]);
 double evaluate_expression_tree(ExpressionNode *root, double x, double y, int depth);
-double evaluate_expression_tree_parallel(ExpressionNode *root, double x, double y, int depth);
-void free_expression_tree(ExpressionNode *root);
-int rand_with_weight(Rule rule);
+int count_expression_nodes(ExpressionNode *root);
+int expression_tree_equal(ExpressionNode *a, ExpressionNode *b);
+ExpressionNode *optimize_expression_tree(ExpressionNode *root);
+void relayout_expression_trees(Arena *dst, Arena *src, ExpressionNode *roots[3], int layout);
+void benchmark_layouts(Arena *arena, ExpressionNode *roots[3], int width, int height);
+void compile_expression_tree(ExpressionNode *root, Program *prog);
+int emit_instructions(ExpressionNode *root, Program *prog, int sp);
+double evaluate_program(Program *prog, double x, double y);
+void evaluate_program_tile(Program *prog, double *xs, double *ys, int n, double *out);
+void fuse_programs(Program progs[3], Program *fused);
+void evaluate_fused_tile(Program *fused, double *stack, int stride,
+        double *xs, double *ys, int n, unsigned char *dst);
+void report_channel_cost(Program progs[3], int width, int height);
+float evaluate_program_float(Program *prog, float x, float y);
+void evaluate_program_tile_float(Program *prog, float *xs, float *ys, int n, float *out);
+void report_float_drift(Program progs[3], int width, int height);
+void free_program(Program *prog);
+void build_dag(ExpressionNode *roots[3], Dag *dag);
+void evaluate_dag(Dag *dag, double x, double y, double *vals, double out[3]);
+void free_dag(Dag *dag);
+void evaluate_dag_interval(Dag *dag, Interval x, Interval y, Interval *ivals, Interval out[3]);
+void build_hoist_plan(Dag *dag, HoistPlan *plan);
+void free_hoist_plan(HoistPlan *plan);
+void build_wavefront_plan(Dag *dag, WavefrontPlan *plan);
+void free_wavefront_plan(WavefrontPlan *plan);
+int jit_compile(Program progs[3], JitCode *jit);
+void free_jit(JitCode *jit);
+void emit_c_source(FILE *file, Program progs[3]);
+int aot_compile(char *src_file, AotCode *aot);
+void free_aot(AotCode *aot);
+void build_alias_table(Rule *rule);
+int rand_with_weight(Rule *rule, Rng *rng);
 void func_info_cpy(FuncInfo *dest, FuncInfo *source);
 char *get_real_line(char *buffer, int buffer_size, FILE *file);
 int find_symbol(char *symbol, char symbol_arr[MAX_RULE_NUM][MAX_SYMBOL_LEN + 1], int symbol_arr_size);
 int find_func(char *func_name);
+int find_engine(char *engine_name);
 int parse_from_file(char *file_name, int entry_symbol_arr[3], Rule grammar[MAX_RULE_NUM]);
 void fill_image_loop_parallel(unsigned char *img, int width, int height,
         ExpressionNode *r_root, ExpressionNode *g_root, ExpressionNode *b_root,
         int threads_cnt);
-void fill_image_rec_parallel(unsigned char *img, int width, int height,
-        ExpressionNode *r_root, ExpressionNode *g_root, ExpressionNode *b_root,
-        int threads_cnt);
+int fill_image_contract(unsigned char *img, int width, int height,
+        Dag *dag, int threads_cnt, int *batch);
+void fill_image_bytecode(unsigned char *img, int width, int height,
+        Program progs[3], int threads_cnt);
+void fill_image_simd(unsigned char *img, int width, int height,
+        Program progs[3], int threads_cnt);
+void fill_image_fused(unsigned char *img, int width, int height,
+        Program *fused, int threads_cnt);
+void fill_image_tiled(unsigned char *img, int width, int height,
+        Program *fused, int tile, int threads_cnt, StealPool *pool);
+int choose_tile_size(Program *fused);
+long fill_image_tasks(unsigned char *img, int width, int height,
+        Program progs[3], int threads_cnt);
+void fill_image_jit(unsigned char *img, int width, int height,
+        JitCode *jit, int threads_cnt);
+void fill_image_aot(unsigned char *img, int width, int height,
+        AotCode *aot, int threads_cnt);
+void fill_image_dag(unsigned char *img, int width, int height,
+        Dag *dag, int threads_cnt);
+void fill_image_hoist(unsigned char *img, int width, int height,
+        Dag *dag, HoistPlan *plan, int threads_cnt);
+void fill_image_wavefront(unsigned char *img, int width, int height,
+        Dag *dag, WavefrontPlan *plan, int threads_cnt);
+long fill_image_cull(unsigned char *img, int width, int height,
+        Dag *dag, int threads_cnt, StealPool *pool);
+long fill_image_adaptive(unsigned char *img, int width, int height,
+        Dag *dag, int threshold, int threads_cnt);
+void fill_image_progressive(unsigned char *img, int width, int height,
+        Dag *dag, int threads_cnt, PassCallback callback, void *data);
+void report_pass(unsigned char *img, int width, int height, int pass, int step, void *data);
+
+int pin_threads(int threads_cnt, int mode);
+void init_numa_layout(int threads_cnt);
+void first_touch_image(unsigned char *img, int width, int height, int shape);
+void replicate_trees(Arena *arena, ExpressionNode *roots[3]);
+void replicate_programs(Program progs[3]);
+void report_numa_layout(void);
+void report_numa_throughput(void);
+void free_numa_layout(void);
+
+void autotune(AutoConfig *best, int width, int height, ExpressionNode *roots[3],
+        Program progs[3], Program *fused, JitCode *jit, Dag *dag);
+int load_auto_config(AutoConfig *cfg, int nodes, int width, int height, char *flags);
+void save_auto_config(AutoConfig *cfg, int nodes, int width, int height, char *flags);
+
+void init_steal_pool(StealPool *pool, int workers_cnt, StealFunc run, void *data);
+void steal_push(StealPool *pool, int worker, long task);
+void steal_run(StealPool *pool);
+void report_steal_stats(StealPool *pool);
+void free_steal_pool(StealPool *pool);
 
 double add(double *nums);
 double mult(double *nums);
@@ -80,342 +476,3997 @@ double sqrt_func(double *nums);
 double mix(double *nums);
 double tan_func(double *nums);
 double eight_sum(double *nums);
+#pragma omp declare simd notinbranch
+double fast_sin_pi(double a);
+#pragma omp declare simd notinbranch
+double fast_exp(double v);
+#pragma omp declare simd notinbranch
+double fast_tan_sigmoid(double a);
+double fast_sin_func(double *nums);
+double fast_tan_func(double *nums);
+Func kernel_func(int op);
 
 
 /* Global variables */
 FuncInfo func_collection[] = {
-    { get_x,       0,   "GET_X" },
-    { get_y,       0,   "GET_Y" },
-    { rand_norm,   0,   "RAND" },
-    { identity,    1,   "ID" },
-    { sin_func,    1,   "SIN" },
-    { tan_func,    1,   "TAN" },
-    { neg_func,    1,   "NEG" },
-    { sqrt_func,   1,   "SQRT" },
-    { add,         2,   "ADD" },
-    { mult,        2,   "MULT" },
-    { mix,         3,   "MIX" },
-    { eight_sum,   8,   "EIGHT_SUM" },
+    { get_x,       0,   "GET_X",       OP_GET_X },
+    { get_y,       0,   "GET_Y",       OP_GET_Y },
+    { rand_norm,   0,   "RAND",        OP_RAND },
+    { identity,    1,   "ID",          OP_ID },
+    { sin_func,    1,   "SIN",         OP_SIN },
+    { tan_func,    1,   "TAN",         OP_TAN },
+    { neg_func,    1,   "NEG",         OP_NEG },
+    { sqrt_func,   1,   "SQRT",        OP_SQRT },
+    { add,         2,   "ADD",         OP_ADD },
+    { mult,        2,   "MULT",        OP_MULT },
+    { mix,         3,   "MIX",         OP_MIX },
+    { eight_sum,   8,   "EIGHT_SUM",   OP_EIGHT_SUM },
+};
+
+/* Use the approximations of SIN and TAN in the compiled engines */
+int fast_math = 0;
+/* Evaluate in single precision in the bytecode and simd engines */
+int use_float = 0;
+/* Set up by --numa; read by the tree, bytecode and simd engines */
+NumaLayout numa = {0};
+
+char *engine_names[] = {
+    "tree",
+    "bytecode",
+    "simd",
+    "jit",
+    "aot",
+    "dag",
+    "hoist",
+    "fused",
+    "cull",
+    "adaptive",
+    "progressive",
+    "tiled",
+    "tasks",
+    "wavefront",
+};
+
+static void arena_out_of_memory(size_t size)
+{
+    fprintf(stderr, "Failed to allocate %zu bytes for the expression trees\n", size);
+    exit(EXIT_FAILURE);
+}
+
+void init_arena(Arena *arena, size_t size)
+{
+    arena->base = (char*)malloc(size);
+    if (!arena->base)
+        arena_out_of_memory(size);
+    arena->len = 0;
+    arena->size = size;
+}
+
+/*
+ * Returns the offset of the new bytes; pointers into the arena may move.
+ * Offsets are ints, so trees that need more than INT_MAX bytes are an error.
+ */
+int arena_alloc(Arena *arena, size_t bytes)
+{
+    int offset = arena->len;
+
+    bytes = (bytes + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+    if (bytes > INT_MAX - arena->len) {
+        fprintf(stderr, "The expression trees exceed %d bytes; use a smaller depth\n", INT_MAX);
+        exit(EXIT_FAILURE);
+    }
+    if (arena->len + bytes > arena->size) {
+        size_t size = arena->size;
+        while (arena->len + bytes > size)
+            size *= 2;
+        char *base = (char*)realloc(arena->base, size);
+        if (!base)
+            arena_out_of_memory(size);
+        arena->base = base;
+        arena->size = size;
+    }
+    arena->len += bytes;
+    return offset;
+}
+
+void free_arena(Arena *arena)
+{
+    free(arena->base);
+    arena->base = NULL;
+    arena->len = arena->size = 0;
+}
+
+ExpressionNode *expression_arg(ExpressionNode *node, int i)
+{
+    return (ExpressionNode*)((char*)node + node->args[i]);
+}
+
+void set_expression_arg(ExpressionNode *node, int i, ExpressionNode *arg)
+{
+    node->args[i] = (char*)arg - (char*)node;
+}
+
+size_t expression_node_size(int arity)
+{
+    return offsetof(ExpressionNode, args) + sizeof(int) * arity;
+}
+
+static uint64_t rotl64(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/* Expand a 64-bit seed into the state with splitmix64 */
+void seed_rng(Rng *rng, uint64_t seed)
+{
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        rng->s[i] = z ^ (z >> 31);
+    }
+}
+
+/* The state is the SHA-256 of the string, so any text names one tree */
+void seed_rng_string(Rng *rng, const char *str)
+{
+    unsigned char digest[32];
+
+    sha256((const unsigned char*)str, strlen(str), digest);
+    for (int i = 0; i < 4; i++) {
+        rng->s[i] = 0;
+        for (int k = 0; k < 8; k++)
+            rng->s[i] = rng->s[i] << 8 | digest[i * 8 + k];
+    }
+    /* xoshiro must not start from the all-zero state */
+    if ((rng->s[0] | rng->s[1] | rng->s[2] | rng->s[3]) == 0)
+        seed_rng(rng, 0);
+}
+
+uint64_t next_rng(Rng *rng)
+{
+    uint64_t *s = rng->s;
+    uint64_t res = rotl64(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+    return res;
+}
+
+/* Uniform in [0, 1) */
+double rng_uniform(Rng *rng)
+{
+    return (next_rng(rng) >> 11) * 0x1.0p-53;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
 };
 
-ExpressionNode *build_expression_tree(Rule *grammar, int pos, int depth)
+static uint32_t rotr32(uint32_t x, int k)
+{
+    return (x >> k) | (x << (32 - k));
+}
+
+static void sha256_block(uint32_t h[8], const unsigned char *block)
+{
+    uint32_t w[64], v[8];
+
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16
+            | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(v, h, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = rotr32(v[4], 6) ^ rotr32(v[4], 11) ^ rotr32(v[4], 25);
+        uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = rotr32(v[0], 2) ^ rotr32(v[0], 13) ^ rotr32(v[0], 22);
+        uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        memmove(&v[1], &v[0], sizeof(uint32_t) * 7);
+        v[4] += t1;
+        v[0] = t1 + s0 + maj;
+    }
+    for (int i = 0; i < 8; i++)
+        h[i] += v[i];
+}
+
+void sha256(const unsigned char *data, size_t len, unsigned char digest[32])
 {
-    Rule rule = grammar[pos];
-    FuncInfo func_chosen;
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    unsigned char tail[128] = {0};
+    size_t full = len / 64 * 64, rest = len - full;
+    int tail_len = rest < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+
+    for (size_t i = 0; i < full; i += 64)
+        sha256_block(h, data + i);
+    memcpy(tail, data + full, rest);
+    tail[rest] = 0x80;
+    for (int i = 0; i < 8; i++)
+        tail[tail_len - 1 - i] = bits >> (i * 8);
+    for (int i = 0; i < tail_len; i += 64)
+        sha256_block(h, tail + i);
+    for (int i = 0; i < 32; i++)
+        digest[i] = h[i / 4] >> (24 - i % 4 * 8);
+}
+
+/*
+ * Returns the offset of the root in the arena; nodes are laid out in pre-order.
+ * The whole subtree draws from one stream, so it is only used below
+ * BUILD_FORK_DEPTH; build_expression_forest builds the levels above.
+ */
+int build_expression_tree(Arena *arena, Rule *grammar, int pos, int depth, Rng *rng)
+{
+    Rule *rule = &grammar[pos];
+    SubRule *sub_rule;
     int func_chosen_idx;
-    ExpressionNode *res = (ExpressionNode*)malloc(sizeof(ExpressionNode));
 
     func_chosen_idx = depth <= 0 ?
-        0 : rand_with_weight(rule);
-    func_chosen = rule.sub_rules[func_chosen_idx].func_info;
-    func_info_cpy(&res->func_info, &func_chosen);
+        0 : rand_with_weight(rule, rng);
+    sub_rule = &rule->sub_rules[func_chosen_idx];
+    int arity = sub_rule->func_info.arity;
+    int res = arena_alloc(arena, expression_node_size(arity));
+    ExpressionNode *node = (ExpressionNode*)(arena->base + res);
+    node->op = sub_rule->func_info.op;
+    node->arity = arity;
 
-    if (depth >= 0 && (double)rand() / RAND_MAX < 0.5)
+    if (depth >= 0 && rng_uniform(rng) < 0.5)
         depth -= 1;
 
-    for (int i = 0; i < rule.sub_rules[func_chosen_idx].func_info.arity; i++) {
-        int arg = rule.sub_rules[func_chosen_idx].args[i];
-        res->args[i] = build_expression_tree(grammar, arg, depth - 1);
+    for (int i = 0; i < arity; i++) {
+        int arg = build_expression_tree(arena, grammar, sub_rule->args[i], depth - 1, rng);
+        /* Building the argument may have moved the arena */
+        node = (ExpressionNode*)(arena->base + res);
+        node->args[i] = arg - res;
+    }
+    node->rand_num = rng_uniform(rng) * 2 - 1;
+
+    return res;
+}
+
+static void add_build_task(TreeBuilder *builder, int pos, int depth, Rng *rng, int parent, int arg)
+{
+    if (builder->tasks_cnt == builder->tasks_size) {
+        builder->tasks_size = builder->tasks_size ? builder->tasks_size * 2 : 16;
+        builder->tasks = (BuildTask*)realloc(builder->tasks, sizeof(BuildTask) * builder->tasks_size);
     }
-    res->rand_num = (double)rand() / RAND_MAX * 2 - 1;
+    BuildTask *task = &builder->tasks[builder->tasks_cnt++];
+    task->pos = pos;
+    task->depth = depth;
+    task->rng = *rng;
+    task->parent = parent;
+    task->arg = arg;
+}
+
+/*
+ * A node at or above BUILD_FORK_DEPTH draws its rule and depth step as in
+ * build_expression_tree, then the seed of each argument's stream, then its
+ * rand_num, all before any child (build_expression_tree draws rand_num after
+ * its children). Every child consumes only its own stream, so the tree
+ * depends on the seed alone and not on the thread count or the order in
+ * which the tasks run, but it differs from a single-stream build. Arguments
+ * below the fork depth become tasks and are linked in once they are built.
+ */
+static int build_upper_node(TreeBuilder *builder, int pos, int depth, Rng *rng)
+{
+    Rule *rule = &builder->grammar[pos];
+    SubRule *sub_rule;
+    Rng arg_rngs[MAX_ARG_NUM];
+
+    sub_rule = &rule->sub_rules[depth <= 0 ? 0 : rand_with_weight(rule, rng)];
+    int arity = sub_rule->func_info.arity;
+    int res = arena_alloc(&builder->upper, expression_node_size(arity));
+    ExpressionNode *node = (ExpressionNode*)(builder->upper.base + res);
+    node->op = sub_rule->func_info.op;
+    node->arity = arity;
+
+    if (depth >= 0 && rng_uniform(rng) < 0.5)
+        depth -= 1;
+    for (int i = 0; i < arity; i++)
+        seed_rng(&arg_rngs[i], next_rng(rng));
+    node->rand_num = rng_uniform(rng) * 2 - 1;
 
+    for (int i = 0; i < arity; i++) {
+        if (depth - 1 < BUILD_FORK_DEPTH) {
+            add_build_task(builder, sub_rule->args[i], depth - 1, &arg_rngs[i], res, i);
+            continue;
+        }
+        int arg = build_upper_node(builder, sub_rule->args[i], depth - 1, &arg_rngs[i]);
+        node = (ExpressionNode*)(builder->upper.base + res);
+        node->args[i] = arg - res;
+    }
     return res;
 }
 
+/*
+ * Build the three trees into one arena. Each root, and each argument of a
+ * node at or above BUILD_FORK_DEPTH, gets a stream seeded from its parent's,
+ * so the trees depend only on the seed. The subtrees below the fork depth are
+ * built in parallel into per-thread arenas and then copied behind the upper
+ * nodes; their offsets are relative, so a plain memcpy moves them.
+ */
+void build_expression_forest(Arena *arena, Rule *grammar, int entry_symbol_arr[3], int depth,
+        Rng *rng, int threads_cnt, int offsets[3])
+{
+    TreeBuilder builder = { .grammar = grammar };
+    Arena *thread_arenas = (Arena*)calloc(threads_cnt, sizeof(Arena));
+
+    init_arena(&builder.upper, ARENA_SIZE);
+    for (int c = 0; c < 3; c++) {
+        Rng root_rng;
+        seed_rng(&root_rng, next_rng(rng));
+        if (depth < BUILD_FORK_DEPTH)
+            add_build_task(&builder, entry_symbol_arr[c], depth, &root_rng, -1, c);
+        else
+            offsets[c] = build_upper_node(&builder, entry_symbol_arr[c], depth, &root_rng);
+    }
+
+#   pragma omp parallel num_threads(threads_cnt)
+    {
+        int t = omp_get_thread_num();
+        init_arena(&thread_arenas[t], ARENA_SIZE);
+
+#       pragma omp for schedule(dynamic, 1)
+        for (int i = 0; i < builder.tasks_cnt; i++) {
+            BuildTask *task = &builder.tasks[i];
+            task->thread = t;
+            task->offset = build_expression_tree(&thread_arenas[t], grammar, task->pos,
+                    task->depth, &task->rng);
+            task->len = thread_arenas[t].len - task->offset;
+        }
+    }
+
+    size_t len = builder.upper.len;
+    for (int i = 0; i < builder.tasks_cnt; i++)
+        len += builder.tasks[i].len;
+    init_arena(arena, len > 0 ? len : ARENA_SIZE);
+    arena_alloc(arena, len);
+    memcpy(arena->base, builder.upper.base, builder.upper.len);
+
+    /* Blocks go in task order, so the layout does not depend on the threads either */
+    int *block_offsets = (int*)malloc(sizeof(int) * (builder.tasks_cnt + 1));
+    block_offsets[0] = builder.upper.len;
+    for (int i = 0; i < builder.tasks_cnt; i++)
+        block_offsets[i + 1] = block_offsets[i] + builder.tasks[i].len;
+
+#   pragma omp parallel for num_threads(threads_cnt) schedule(dynamic, 1)
+    for (int i = 0; i < builder.tasks_cnt; i++) {
+        BuildTask *task = &builder.tasks[i];
+        memcpy(arena->base + block_offsets[i], thread_arenas[task->thread].base + task->offset,
+                task->len);
+        if (task->parent < 0) {
+            offsets[task->arg] = block_offsets[i];
+        } else {
+            ExpressionNode *parent = (ExpressionNode*)(arena->base + task->parent);
+            parent->args[task->arg] = block_offsets[i] - task->parent;
+        }
+    }
+
+    for (int t = 0; t < threads_cnt; t++)
+        free_arena(&thread_arenas[t]);
+    free(thread_arenas);
+    free(block_offsets);
+    free(builder.tasks);
+    free_arena(&builder.upper);
+}
+
 double evaluate_expression_tree(ExpressionNode *root, double x, double y, int depth)
 {
     double params[MAX_ARG_NUM];
     double res;
 
-    if (root->func_info.arity == 0) {
+    if (root->arity == 0) {
         params[X] = x;
         params[Y] = y;
         params[RAND_NUM] = root->rand_num;
-        return root->func_info.func(params);
+        return func_collection[root->op].func(params);
     }
 
-    for (int i = 0; i < root->func_info.arity; i++) {
-        params[i] = evaluate_expression_tree(root->args[i], x, y, depth + 1);
+    for (int i = 0; i < root->arity; i++) {
+        params[i] = evaluate_expression_tree(expression_arg(root, i), x, y, depth + 1);
     }
 
-    res = root->func_info.func(params);
+    res = func_collection[root->op].func(params);
     return res;
 }
 
-double evaluate_expression_tree_parallel(ExpressionNode *root, double x, double y, int depth)
+void print_expression_tree(ExpressionNode *root)
 {
-    double params[MAX_ARG_NUM];
-    double res;
+    printf("%s", func_collection[root->op].func_name);
+    printf("(");
+    for (int i = 0; i < root->arity; i++) {
+        print_expression_tree(expression_arg(root, i));
+        if (i != root->arity - 1)
+            printf(", ");
+    }
+    printf(")");
+}
 
-    if (root->func_info.arity == 0) {
-        params[X] = x;
-        params[Y] = y;
-        params[RAND_NUM] = root->rand_num;
-        return root->func_info.func(params);
+int count_expression_nodes(ExpressionNode *root)
+{
+    int cnt = 1;
+    for (int i = 0; i < root->arity; i++) {
+        cnt += count_expression_nodes(expression_arg(root, i));
     }
+    return cnt;
+}
 
-    if (depth < DEPTH_THRESHOLD) {
-        for (int i = 0; i < root->func_info.arity; i++) {
-#           pragma omp task shared(params)
-            params[i] = evaluate_expression_tree(root->args[i], x, y, depth + 1);
-        }
+int expression_tree_equal(ExpressionNode *a, ExpressionNode *b)
+{
+    if (a->op != b->op)
+        return 0;
+    if (a->op == OP_RAND)
+        return a->rand_num == b->rand_num;
+    for (int i = 0; i < a->arity; i++) {
+        if (!expression_tree_equal(expression_arg(a, i), expression_arg(b, i)))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Simplify the tree bottom-up and return the new root; nodes that are no
+ * longer referenced stay in the arena. All rewrites give bit-identical values:
+ *   - a node whose arguments are all RAND is folded into a RAND leaf
+ *   - ID(e) -> e
+ *   - NEG(NEG(e)) -> e
+ *   - ADD(e, e) -> e, since (e + e) / 2 is exact
+ */
+ExpressionNode *optimize_expression_tree(ExpressionNode *root)
+{
+    int arity = root->arity;
+    int all_const = arity > 0;
 
-#       pragma omp taskwait
+    for (int i = 0; i < arity; i++) {
+        set_expression_arg(root, i, optimize_expression_tree(expression_arg(root, i)));
+        if (expression_arg(root, i)->op != OP_RAND)
+            all_const = 0;
     }
-    else {
-        for (int i = 0; i < root->func_info.arity; i++) {
-            params[i] = evaluate_expression_tree(root->args[i], x, y, depth + 1);
-        }
+
+    if (all_const) {
+        double params[MAX_ARG_NUM];
+        for (int i = 0; i < arity; i++)
+            params[i] = expression_arg(root, i)->rand_num;
+        root->rand_num = func_collection[root->op].func(params);
+        root->op = OP_RAND;
+        root->arity = 0;
+        return root;
     }
 
-    res = root->func_info.func(params);
-    return res;
+    switch (root->op) {
+    case OP_ID:
+        return expression_arg(root, 0);
+    case OP_NEG:
+        if (expression_arg(root, 0)->op != OP_NEG)
+            break;
+        return expression_arg(expression_arg(root, 0), 0);
+    case OP_ADD:
+        if (!expression_tree_equal(expression_arg(root, 0), expression_arg(root, 1)))
+            break;
+        return expression_arg(root, 0);
+    }
+
+    return root;
+}
+
+static void layout_dfs(ExpressionNode *root, ExpressionNode **order, int *cnt)
+{
+    order[(*cnt)++] = root;
+    for (int i = 0; i < root->arity; i++)
+        layout_dfs(expression_arg(root, i), order, cnt);
 }
 
-void free_expression_tree(ExpressionNode *root)
+static int expression_tree_height(ExpressionNode *root)
 {
-    for (int i = 0; i < root->func_info.arity; i++) {
-        free_expression_tree(root->args[i]);
+    int height = 0;
+
+    for (int i = 0; i < root->arity; i++) {
+        int h = expression_tree_height(expression_arg(root, i));
+        if (h > height)
+            height = h;
     }
+    return height + 1;
+}
 
-    free(root);
+static void layout_veb(ExpressionNode *root, int levels, ExpressionNode **order, int *cnt);
+
+/* Lay out every subtree rooted `depth` levels below root, each in `levels` levels */
+static void layout_veb_bottom(ExpressionNode *root, int depth, int levels,
+        ExpressionNode **order, int *cnt)
+{
+    if (depth == 0) {
+        layout_veb(root, levels, order, cnt);
+        return;
+    }
+    for (int i = 0; i < root->arity; i++)
+        layout_veb_bottom(expression_arg(root, i), depth - 1, levels, order, cnt);
 }
 
-void print_expression_tree(ExpressionNode *root)
+/* Lay out the first `levels` levels of the subtree at root */
+static void layout_veb(ExpressionNode *root, int levels, ExpressionNode **order, int *cnt)
 {
-    printf("%s", root->func_info.func_name);
-    printf("(");
-    for (int i = 0; i < root->func_info.arity; i++) {
-        print_expression_tree(root->args[i]);
-        if (i != root->func_info.arity - 1)
-            printf(", ");
+    if (levels == 1) {
+        order[(*cnt)++] = root;
+        return;
     }
-    printf(")");
+    int top = levels / 2;
+    layout_veb(root, top, order, cnt);
+    layout_veb_bottom(root, top, levels - top, order, cnt);
 }
 
-int rand_with_weight(Rule rule)
+/*
+ * Copy the three trees into a fresh arena in the given node order and point
+ * roots at the copies. Nodes left unreferenced by the optimizer are dropped.
+ */
+void relayout_expression_trees(Arena *dst, Arena *src, ExpressionNode *roots[3], int layout)
 {
-    float rand_value = (float)rand() / (float)RAND_MAX;
-    float acc_prob = 0;
-    int i = 0;
+    int nodes_cnt = 0, cnt = 0;
+    for (int c = 0; c < 3; c++)
+        nodes_cnt += count_expression_nodes(roots[c]);
+    ExpressionNode **order = (ExpressionNode**)malloc(sizeof(ExpressionNode*) * nodes_cnt);
+    /* New offset of each node, indexed by its old offset in doubles */
+    int *moved = (int*)malloc(sizeof(int) * (src->len / sizeof(double) + 1));
 
-    for (; i < rule.func_num; i++) {
-        acc_prob += rule.sub_rules[i].prob;
-        if (rand_value < acc_prob)
-            return i;
+    for (int c = 0; c < 3; c++) {
+        if (layout == LAYOUT_VEB)
+            layout_veb(roots[c], expression_tree_height(roots[c]), order, &cnt);
+        else
+            layout_dfs(roots[c], order, &cnt);
+    }
+    if (layout == LAYOUT_SCATTER) {
+        Rng rng;
+        seed_rng(&rng, nodes_cnt);
+        for (int i = nodes_cnt - 1; i > 0; i--) {
+            int k = next_rng(&rng) % (i + 1);
+            ExpressionNode *tmp = order[i];
+            order[i] = order[k];
+            order[k] = tmp;
+        }
     }
 
-    if (i != 0)
-        return i - 1;
-    return 0;
+    init_arena(dst, src->len > 0 ? src->len : ARENA_SIZE);
+    for (int i = 0; i < nodes_cnt; i++) {
+        int offset = arena_alloc(dst, expression_node_size(order[i]->arity));
+        ExpressionNode *node = (ExpressionNode*)(dst->base + offset);
+        node->rand_num = order[i]->rand_num;
+        node->op = order[i]->op;
+        node->arity = order[i]->arity;
+        moved[((char*)order[i] - src->base) / sizeof(double)] = offset;
+    }
+    for (int i = 0; i < nodes_cnt; i++) {
+        int offset = moved[((char*)order[i] - src->base) / sizeof(double)];
+        ExpressionNode *node = (ExpressionNode*)(dst->base + offset);
+        for (int k = 0; k < node->arity; k++) {
+            char *arg = (char*)expression_arg(order[i], k);
+            node->args[k] = moved[(arg - src->base) / sizeof(double)] - offset;
+        }
+    }
+    for (int c = 0; c < 3; c++)
+        roots[c] = (ExpressionNode*)(dst->base + moved[((char*)roots[c] - src->base) / sizeof(double)]);
+
+    free(moved);
+    free(order);
 }
 
-void func_info_cpy(FuncInfo *dest, FuncInfo *source)
+/* A hardware cache counter of the calling thread, or -1 if perf events are unavailable */
+static int open_cache_counter(int cache)
 {
-    dest->func = source->func;
-    dest->arity = source->arity;
-    strcpy(dest->func_name, source->func_name);
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
 }
 
-char *get_real_line(char *buffer, int buffer_size, FILE *file)
+static void print_cache_misses(const char *name, int fd, long pixels)
 {
-    char *res;
-    char *buffer_cpy = (char*)malloc(sizeof(char) * buffer_size);
-    while ((res = fgets(buffer, buffer_size, file))) {
-        char *first_char;
-        strcpy(buffer_cpy, buffer);
-        first_char = strtok(buffer_cpy, " \t\n");
-        if (first_char && first_char[0] != '#') {
+    long long misses;
+
+    if (fd < 0 || read(fd, &misses, sizeof(misses)) != sizeof(misses))
+        printf(", %s misses unavailable", name);
+    else
+        printf(", %s misses %lld (%.2f per pixel)", name, misses, (double)misses / pixels);
+}
+
+/*
+ * Render with the tree engine on one thread once per layout, and report the
+ * time and the L1D and last-level read misses of each. perf has no generic
+ * L2 event, so the last level stands in for the outer caches.
+ */
+void benchmark_layouts(Arena *arena, ExpressionNode *roots[3], int width, int height)
+{
+    unsigned char *img = (unsigned char*)malloc(sizeof(unsigned char) * height * width * 3);
+    long pixels = (long)width * height;
+
+    for (int layout = 0; layout < sizeof(layout_names) / sizeof(char*); layout++) {
+        Arena laid = *arena;
+        ExpressionNode *laid_roots[3] = { roots[0], roots[1], roots[2] };
+        if (layout != LAYOUT_BUILD)
+            relayout_expression_trees(&laid, arena, laid_roots, layout);
+
+        int l1d = open_cache_counter(PERF_COUNT_HW_CACHE_L1D);
+        int ll = open_cache_counter(PERF_COUNT_HW_CACHE_LL);
+        double tstart = omp_get_wtime();
+        if (l1d >= 0)
+            ioctl(l1d, PERF_EVENT_IOC_ENABLE, 0);
+        if (ll >= 0)
+            ioctl(ll, PERF_EVENT_IOC_ENABLE, 0);
+        fill_image_loop_parallel(img, width, height, laid_roots[0], laid_roots[1], laid_roots[2], 1);
+        if (l1d >= 0)
+            ioctl(l1d, PERF_EVENT_IOC_DISABLE, 0);
+        if (ll >= 0)
+            ioctl(ll, PERF_EVENT_IOC_DISABLE, 0);
+        double ttaken = omp_get_wtime() - tstart;
+
+        printf("Layout %-7s: %zu bytes, %.4f s", layout_names[layout], laid.len, ttaken);
+        print_cache_misses("L1D", l1d, pixels);
+        print_cache_misses("LL", ll, pixels);
+        printf("\n");
+        if (l1d >= 0)
+            close(l1d);
+        if (ll >= 0)
+            close(ll);
+        if (layout != LAYOUT_BUILD)
+            free_arena(&laid);
+    }
+    free(img);
+}
+
+/*
+ * Lower the tree into postfix order: the arguments of a node are pushed
+ * from left to right, so that the top `arity` slots of the stack form
+ * exactly the params array the node's function expects.
+ */
+void compile_expression_tree(ExpressionNode *root, Program *prog)
+{
+    prog->code = (Instruction*)malloc(sizeof(Instruction) * count_expression_nodes(root));
+    prog->len = 0;
+    prog->stack_size = 1;
+    emit_instructions(root, prog, 0);
+}
+
+/* Returns the maximum stack depth reached while evaluating the subtree */
+int emit_instructions(ExpressionNode *root, Program *prog, int sp)
+{
+    int max_sp = sp + 1;
+
+    for (int i = 0; i < root->arity; i++) {
+        int child_sp = emit_instructions(expression_arg(root, i), prog, sp + i);
+        if (child_sp > max_sp)
+            max_sp = child_sp;
+    }
+    prog->code[prog->len].op = root->op;
+    prog->code[prog->len].imm = root->rand_num;
+    prog->len++;
+
+    if (max_sp > prog->stack_size)
+        prog->stack_size = max_sp;
+    return max_sp;
+}
+
+double evaluate_program(Program *prog, double x, double y)
+{
+    double stack[prog->stack_size];
+    int sp = 0;
+
+    for (int pc = 0; pc < prog->len; pc++) {
+        Instruction *ins = &prog->code[pc];
+        switch (ins->op) {
+        case OP_GET_X:
+            stack[sp++] = x;
+            break;
+        case OP_GET_Y:
+            stack[sp++] = y;
+            break;
+        case OP_RAND:
+            stack[sp++] = ins->imm;
+            break;
+        case OP_ID:
+            break;
+        case OP_SIN:
+            stack[sp - 1] = fast_math ? fast_sin_pi(stack[sp - 1]) : sin(PI * stack[sp - 1]);
+            break;
+        case OP_TAN:
+            stack[sp - 1] = fast_math ? fast_tan_sigmoid(stack[sp - 1])
+                : 1 / (1 + exp(-tan(PI * stack[sp - 1]))) * 2 - 1;
+            break;
+        case OP_NEG:
+            stack[sp - 1] = -stack[sp - 1];
+            break;
+        case OP_SQRT:
+            stack[sp - 1] = sqrt((stack[sp - 1] + 1) * 2) - 1;
+            break;
+        case OP_ADD:
+            sp--;
+            stack[sp - 1] = (stack[sp - 1] + stack[sp]) / 2;
+            break;
+        case OP_MULT:
+            sp--;
+            stack[sp - 1] = stack[sp - 1] * stack[sp];
+            break;
+        case OP_MIX: {
+            double prop = (stack[sp - 1] + 1) / 2;
+            sp -= 2;
+            stack[sp - 1] = stack[sp - 1] * prop + stack[sp] * (1 - prop);
+            break;
+        }
+        default:
+            /* Rarely used functions go through func_collection */
+            sp -= func_collection[ins->op].arity;
+            stack[sp] = kernel_func(ins->op)(&stack[sp]);
+            sp++;
             break;
         }
     }
-    free(buffer_cpy);
-    return res;
+
+    return stack[0];
 }
 
-int find_symbol(char *symbol, char symbol_arr[MAX_RULE_NUM][MAX_SYMBOL_LEN + 1], int symbol_arr_size)
+/*
+ * Execute one instruction over n <= stride lanes and return the new stack
+ * pointer. Stack slot k is the vector stack[k * stride ...], so the
+ * dispatch is paid once per tile and each kernel is a plain loop the
+ * compiler can vectorize.
+ */
+static inline int execute_tile_instruction(Instruction *ins, double *stack, int stride, int sp,
+        double *xs, double *ys, int n)
 {
-    for (int i = 0; i < symbol_arr_size; i++) {
-        if (strcmp(symbol, symbol_arr[i]) == 0) {
-            return i;
+    /* a is the top of the stack, b and c the slots below it */
+    double *a = &stack[(sp > 0 ? sp - 1 : 0) * stride];
+    double *b = &stack[(sp > 1 ? sp - 2 : 0) * stride];
+    double *c = &stack[(sp > 2 ? sp - 3 : 0) * stride];
+
+    switch (ins->op) {
+    case OP_GET_X:
+        memcpy(&stack[sp++ * stride], xs, sizeof(double) * n);
+        break;
+    case OP_GET_Y:
+        memcpy(&stack[sp++ * stride], ys, sizeof(double) * n);
+        break;
+    case OP_RAND: {
+        double *d = &stack[sp++ * stride];
+        double imm = ins->imm;
+#       pragma omp simd
+        for (int k = 0; k < n; k++)
+            d[k] = imm;
+        break;
+    }
+    case OP_ID:
+        break;
+    case OP_SIN:
+        if (fast_math) {
+#           pragma omp simd
+            for (int k = 0; k < n; k++)
+                a[k] = fast_sin_pi(a[k]);
+            break;
+        }
+#       pragma omp simd
+        for (int k = 0; k < n; k++)
+            a[k] = sin(PI * a[k]);
+        break;
+    case OP_TAN:
+        if (fast_math) {
+#           pragma omp simd
+            for (int k = 0; k < n; k++)
+                a[k] = fast_tan_sigmoid(a[k]);
+            break;
+        }
+#       pragma omp simd
+        for (int k = 0; k < n; k++)
+            a[k] = 1 / (1 + exp(-tan(PI * a[k]))) * 2 - 1;
+        break;
+    case OP_NEG:
+#       pragma omp simd
+        for (int k = 0; k < n; k++)
+            a[k] = -a[k];
+        break;
+    case OP_SQRT:
+#       pragma omp simd
+        for (int k = 0; k < n; k++)
+            a[k] = sqrt((a[k] + 1) * 2) - 1;
+        break;
+    case OP_ADD:
+#       pragma omp simd
+        for (int k = 0; k < n; k++)
+            b[k] = (b[k] + a[k]) / 2;
+        sp--;
+        break;
+    case OP_MULT:
+#       pragma omp simd
+        for (int k = 0; k < n; k++)
+            b[k] = b[k] * a[k];
+        sp--;
+        break;
+    case OP_MIX:
+#       pragma omp simd
+        for (int k = 0; k < n; k++) {
+            double prop = (a[k] + 1) / 2;
+            c[k] = c[k] * prop + b[k] * (1 - prop);
+        }
+        sp -= 2;
+        break;
+    default: {
+        /* Rarely used functions go through func_collection lane by lane */
+        int arity = func_collection[ins->op].arity;
+        double params[MAX_ARG_NUM];
+        sp -= arity;
+        for (int k = 0; k < n; k++) {
+            for (int i = 0; i < arity; i++)
+                params[i] = stack[(sp + i) * stride + k];
+            stack[sp * stride + k] = kernel_func(ins->op)(params);
+        }
+        sp++;
+        break;
+    }
+    }
+
+    return sp;
+}
+
+void evaluate_program_tile(Program *prog, double *xs, double *ys, int n, double *out)
+{
+    double stack[prog->stack_size * TILE_WIDTH];
+    int sp = 0;
+
+    for (int pc = 0; pc < prog->len; pc++)
+        sp = execute_tile_instruction(&prog->code[pc], stack, TILE_WIDTH, sp, xs, ys, n);
+
+    memcpy(out, stack, sizeof(double) * n);
+}
+
+/*
+ * Concatenate the three channel programs into one, each followed by an
+ * OP_STORE of its result, so that a tile is evaluated for all channels in
+ * a single pass with one set of coordinates.
+ */
+void fuse_programs(Program progs[3], Program *fused)
+{
+    fused->len = 0;
+    fused->stack_size = 1;
+    fused->code = (Instruction*)malloc(sizeof(Instruction)
+            * (progs[0].len + progs[1].len + progs[2].len + 3));
+
+    for (int c = 0; c < 3; c++) {
+        memcpy(&fused->code[fused->len], progs[c].code, sizeof(Instruction) * progs[c].len);
+        fused->len += progs[c].len;
+        fused->code[fused->len].op = OP_STORE;
+        fused->code[fused->len].imm = c;
+        fused->len++;
+        if (progs[c].stack_size > fused->stack_size)
+            fused->stack_size = progs[c].stack_size;
+    }
+}
+
+/*
+ * stack is scratch space of fused->stack_size * stride doubles for n <=
+ * stride lanes; dst receives the n RGB triples of the tile
+ */
+void evaluate_fused_tile(Program *fused, double *stack, int stride,
+        double *xs, double *ys, int n, unsigned char *dst)
+{
+    int sp = 0;
+
+    for (int pc = 0; pc < fused->len; pc++) {
+        Instruction *ins = &fused->code[pc];
+        if (ins->op == OP_STORE) {
+            int c = ins->imm;
+            sp--;
+            for (int k = 0; k < n; k++)
+                dst[k * 3 + c] = (stack[sp * stride + k] + 1) / 2 * 255;
+            continue;
+        }
+        sp = execute_tile_instruction(ins, stack, stride, sp, xs, ys, n);
+    }
+}
+
+/*
+ * Time every channel on a few rows of the image, so that the share of each
+ * channel in the fused pass stays visible.
+ */
+void report_channel_cost(Program progs[3], int width, int height)
+{
+    char *channel_names[] = { "R", "G", "B" };
+    double xs[TILE_WIDTH], ys[TILE_WIDTH], vals[TILE_WIDTH];
+    double channel_time[3], total_time = 0;
+    int rows = height < 16 ? height : 16;
+
+    for (int c = 0; c < 3; c++) {
+        double tstart = omp_get_wtime();
+        for (int r = 0; r < rows; r++) {
+            int i = r * (height / rows);
+            for (int j0 = 0; j0 < width; j0 += TILE_WIDTH) {
+                int n = width - j0 < TILE_WIDTH ? width - j0 : TILE_WIDTH;
+                for (int k = 0; k < n; k++) {
+                    xs[k] = (double)i / (double)height * 2 - 1;
+                    ys[k] = (double)(j0 + k) / (double)width * 2 - 1;
+                }
+                evaluate_program_tile(&progs[c], xs, ys, n, vals);
+            }
+        }
+        channel_time[c] = omp_get_wtime() - tstart;
+        total_time += channel_time[c];
+    }
+
+    for (int c = 0; c < 3; c++) {
+        printf("Channel %s: %d instructions, %.1f%% of the sampled evaluation time\n",
+                channel_names[c], progs[c].len,
+                total_time > 0 ? channel_time[c] / total_time * 100 : 0);
+    }
+}
+
+/*
+ * Single precision versions of evaluate_program and evaluate_program_tile.
+ * Rarely used functions still go through the double precision Func.
+ */
+float evaluate_program_float(Program *prog, float x, float y)
+{
+    float stack[prog->stack_size];
+    int sp = 0;
+
+    for (int pc = 0; pc < prog->len; pc++) {
+        Instruction *ins = &prog->code[pc];
+        switch (ins->op) {
+        case OP_GET_X:
+            stack[sp++] = x;
+            break;
+        case OP_GET_Y:
+            stack[sp++] = y;
+            break;
+        case OP_RAND:
+            stack[sp++] = ins->imm;
+            break;
+        case OP_ID:
+            break;
+        case OP_SIN:
+            stack[sp - 1] = sinf((float)PI * stack[sp - 1]);
+            break;
+        case OP_TAN:
+            stack[sp - 1] = 1 / (1 + expf(-tanf((float)PI * stack[sp - 1]))) * 2 - 1;
+            break;
+        case OP_NEG:
+            stack[sp - 1] = -stack[sp - 1];
+            break;
+        case OP_SQRT:
+            stack[sp - 1] = sqrtf((stack[sp - 1] + 1) * 2) - 1;
+            break;
+        case OP_ADD:
+            sp--;
+            stack[sp - 1] = (stack[sp - 1] + stack[sp]) / 2;
+            break;
+        case OP_MULT:
+            sp--;
+            stack[sp - 1] = stack[sp - 1] * stack[sp];
+            break;
+        case OP_MIX: {
+            float prop = (stack[sp - 1] + 1) / 2;
+            sp -= 2;
+            stack[sp - 1] = stack[sp - 1] * prop + stack[sp] * (1 - prop);
+            break;
+        }
+        default: {
+            double params[MAX_ARG_NUM];
+            int arity = func_collection[ins->op].arity;
+            sp -= arity;
+            for (int i = 0; i < arity; i++)
+                params[i] = stack[sp + i];
+            stack[sp] = kernel_func(ins->op)(params);
+            sp++;
+            break;
+        }
+        }
+    }
+
+    return stack[0];
+}
+
+void evaluate_program_tile_float(Program *prog, float *xs, float *ys, int n, float *out)
+{
+    float stack[prog->stack_size][TILE_WIDTH];
+    int sp = 0;
+
+    for (int pc = 0; pc < prog->len; pc++) {
+        Instruction *ins = &prog->code[pc];
+        float *a = stack[sp > 0 ? sp - 1 : 0];
+        float *b = stack[sp > 1 ? sp - 2 : 0];
+        float *c = stack[sp > 2 ? sp - 3 : 0];
+
+        switch (ins->op) {
+        case OP_GET_X:
+            memcpy(stack[sp++], xs, sizeof(float) * n);
+            break;
+        case OP_GET_Y:
+            memcpy(stack[sp++], ys, sizeof(float) * n);
+            break;
+        case OP_RAND: {
+            float *d = stack[sp++];
+            float imm = ins->imm;
+#           pragma omp simd
+            for (int k = 0; k < n; k++)
+                d[k] = imm;
+            break;
+        }
+        case OP_ID:
+            break;
+        case OP_SIN:
+#           pragma omp simd
+            for (int k = 0; k < n; k++)
+                a[k] = sinf((float)PI * a[k]);
+            break;
+        case OP_TAN:
+#           pragma omp simd
+            for (int k = 0; k < n; k++)
+                a[k] = 1 / (1 + expf(-tanf((float)PI * a[k]))) * 2 - 1;
+            break;
+        case OP_NEG:
+#           pragma omp simd
+            for (int k = 0; k < n; k++)
+                a[k] = -a[k];
+            break;
+        case OP_SQRT:
+#           pragma omp simd
+            for (int k = 0; k < n; k++)
+                a[k] = sqrtf((a[k] + 1) * 2) - 1;
+            break;
+        case OP_ADD:
+#           pragma omp simd
+            for (int k = 0; k < n; k++)
+                b[k] = (b[k] + a[k]) / 2;
+            sp--;
+            break;
+        case OP_MULT:
+#           pragma omp simd
+            for (int k = 0; k < n; k++)
+                b[k] = b[k] * a[k];
+            sp--;
+            break;
+        case OP_MIX:
+#           pragma omp simd
+            for (int k = 0; k < n; k++) {
+                float prop = (a[k] + 1) / 2;
+                c[k] = c[k] * prop + b[k] * (1 - prop);
+            }
+            sp -= 2;
+            break;
+        default: {
+            int arity = func_collection[ins->op].arity;
+            double params[MAX_ARG_NUM];
+            sp -= arity;
+            for (int k = 0; k < n; k++) {
+                for (int i = 0; i < arity; i++)
+                    params[i] = stack[sp + i][k];
+                stack[sp][k] = kernel_func(ins->op)(params);
+            }
+            sp++;
+            break;
+        }
+        }
+    }
+
+    memcpy(out, stack[0], sizeof(float) * n);
+}
+
+/*
+ * Evaluate an evenly spaced sample of at most 128 x 128 pixels in double
+ * and in single precision and report how far the 8-bit outputs drift apart.
+ */
+void report_float_drift(Program progs[3], int width, int height)
+{
+    int step_i = (height + 127) / 128;
+    int step_j = (width + 127) / 128;
+    int sample_cnt = 0, diff_cnt = 0, diff_max = 0;
+
+    for (int i = 0; i < height; i += step_i) {
+        for (int j = 0; j < width; j += step_j) {
+            double x_norm = (double)i / (double)height * 2 - 1;
+            double y_norm = (double)j / (double)width * 2 - 1;
+            for (int c = 0; c < 3; c++) {
+                unsigned char exact = (evaluate_program(&progs[c], x_norm, y_norm) + 1) / 2 * 255;
+                unsigned char approx = (evaluate_program_float(&progs[c], x_norm, y_norm) + 1) / 2 * 255;
+                int diff = abs(exact - approx);
+                if (diff) {
+                    diff_cnt++;
+                    if (diff > diff_max)
+                        diff_max = diff;
+                }
+            }
+            sample_cnt++;
+        }
+    }
+
+    printf("Float drift over %d sampled pixels: %d of %d channels differ, max 8-bit difference %d\n",
+            sample_cnt, diff_cnt, sample_cnt * 3, diff_max);
+}
+
+void free_program(Program *prog)
+{
+    free(prog->code);
+    prog->code = NULL;
+    prog->len = 0;
+}
+
+typedef struct DagTable {
+    int *slots;
+    unsigned int mask;
+} DagTable;
+
+static unsigned long long dag_hash(int op, double imm, int *args, int arity)
+{
+    unsigned long long h = 1469598103934665603ULL;
+    unsigned long long bits;
+
+    memcpy(&bits, &imm, sizeof(bits));
+    h = (h ^ (unsigned)op) * 1099511628211ULL;
+    h = (h ^ bits) * 1099511628211ULL;
+    for (int i = 0; i < arity; i++)
+        h = (h ^ (unsigned)args[i]) * 1099511628211ULL;
+    return h ^ (h >> 29);
+}
+
+/* Returns the index of the node, appending it unless an equal one exists */
+static int dag_intern(Dag *dag, DagTable *table, int op, double imm, int *args, int arity)
+{
+    unsigned int pos = dag_hash(op, imm, args, arity) & table->mask;
+
+    for (; table->slots[pos] >= 0; pos = (pos + 1) & table->mask) {
+        DagNode *node = &dag->nodes[table->slots[pos]];
+        if (node->op == op && node->imm == imm && node->arity == arity
+                && memcmp(&dag->args[node->first_arg], args, sizeof(int) * arity) == 0)
+            return table->slots[pos];
+    }
+
+    DagNode *node = &dag->nodes[dag->len];
+    node->op = op;
+    node->arity = arity;
+    node->imm = imm;
+    node->first_arg = dag->args_len;
+    memcpy(&dag->args[dag->args_len], args, sizeof(int) * arity);
+    dag->args_len += arity;
+    table->slots[pos] = dag->len;
+    return dag->len++;
+}
+
+static int dag_insert_tree(Dag *dag, DagTable *table, ExpressionNode *root)
+{
+    int args[MAX_ARG_NUM];
+    int op = root->op;
+
+    for (int i = 0; i < root->arity; i++)
+        args[i] = dag_insert_tree(dag, table, expression_arg(root, i));
+    /* Only RAND reads its constant; the others must not differ by it */
+    return dag_intern(dag, table, op, op == OP_RAND ? root->rand_num : 0,
+            args, root->arity);
+}
+
+void build_dag(ExpressionNode *roots[3], Dag *dag)
+{
+    int total = 0;
+    DagTable table;
+
+    for (int c = 0; c < 3; c++)
+        total += count_expression_nodes(roots[c]);
+
+    dag->nodes = (DagNode*)malloc(sizeof(DagNode) * total);
+    dag->args = (int*)malloc(sizeof(int) * total);
+    dag->len = 0;
+    dag->args_len = 0;
+
+    table.mask = 1;
+    while (table.mask < 2 * total)
+        table.mask <<= 1;
+    table.slots = (int*)malloc(sizeof(int) * table.mask);
+    memset(table.slots, -1, sizeof(int) * table.mask);
+    table.mask -= 1;
+
+    for (int c = 0; c < 3; c++)
+        dag->roots[c] = dag_insert_tree(dag, &table, roots[c]);
+
+    free(table.slots);
+}
+
+static inline void evaluate_dag_node(Dag *dag, int n, double x, double y, double *vals)
+{
+    DagNode *node = &dag->nodes[n];
+    int *args = &dag->args[node->first_arg];
+
+    switch (node->op) {
+    case OP_GET_X:
+        vals[n] = x;
+        break;
+    case OP_GET_Y:
+        vals[n] = y;
+        break;
+    case OP_RAND:
+        vals[n] = node->imm;
+        break;
+    case OP_ID:
+        vals[n] = vals[args[0]];
+        break;
+    case OP_SIN:
+        vals[n] = fast_math ? fast_sin_pi(vals[args[0]]) : sin(PI * vals[args[0]]);
+        break;
+    case OP_NEG:
+        vals[n] = -vals[args[0]];
+        break;
+    case OP_ADD:
+        vals[n] = (vals[args[0]] + vals[args[1]]) / 2;
+        break;
+    case OP_MULT:
+        vals[n] = vals[args[0]] * vals[args[1]];
+        break;
+    default: {
+        double params[MAX_ARG_NUM];
+        for (int i = 0; i < node->arity; i++)
+            params[i] = vals[args[i]];
+        vals[n] = kernel_func(node->op)(params);
+        break;
+    }
+    }
+}
+
+/* vals is scratch space of dag->len doubles, one per node */
+void evaluate_dag(Dag *dag, double x, double y, double *vals, double out[3])
+{
+    for (int n = 0; n < dag->len; n++)
+        evaluate_dag_node(dag, n, x, y, vals);
+
+    for (int c = 0; c < 3; c++)
+        out[c] = vals[dag->roots[c]];
+}
+
+static Interval interval_mult(Interval a, Interval b)
+{
+    double p[4] = { a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi };
+    Interval res = { p[0], p[0] };
+    for (int i = 1; i < 4; i++) {
+        res.lo = p[i] < res.lo ? p[i] : res.lo;
+        res.hi = p[i] > res.hi ? p[i] : res.hi;
+    }
+    return res;
+}
+
+/* Bounds of sin(PI * a): the extremes are reached at the ends or at peaks */
+static Interval interval_sin(Interval a)
+{
+    double lo = PI * a.lo, hi = PI * a.hi;
+    Interval res = { sin(lo), sin(lo) };
+
+    if (hi - lo >= 2 * M_PI)
+        return (Interval){ -1, 1 };
+    res.lo = fmin(res.lo, sin(hi));
+    res.hi = fmax(res.hi, sin(hi));
+    if (floor((hi - M_PI_2) / (2 * M_PI)) != floor((lo - M_PI_2) / (2 * M_PI)))
+        res.hi = 1;
+    if (floor((hi + M_PI_2) / (2 * M_PI)) != floor((lo + M_PI_2) / (2 * M_PI)))
+        res.lo = -1;
+    return res;
+}
+
+/* tan_func increases between the poles of tan(PI * a) */
+static Interval interval_tan(Interval a)
+{
+    double lo = PI * a.lo, hi = PI * a.hi;
+    double params[MAX_ARG_NUM];
+
+    if (floor((hi - M_PI_2) / M_PI) != floor((lo - M_PI_2) / M_PI))
+        return (Interval){ -1, 1 };
+    params[0] = a.lo;
+    double f_lo = kernel_func(OP_TAN)(params);
+    params[0] = a.hi;
+    double f_hi = kernel_func(OP_TAN)(params);
+    return (Interval){ f_lo, f_hi };
+}
+
+/*
+ * Bound every node of the DAG over the rectangle x * y. All functions are
+ * handled by their monotonicity or by their extremes; each bound is widened
+ * by a small epsilon (larger with --fast-math) so that rounding in the
+ * pointwise evaluation can never leave it. Unbounded or undefined results
+ * become [-inf, inf].
+ */
+void evaluate_dag_interval(Dag *dag, Interval x, Interval y, Interval *ivals, Interval out[3])
+{
+    double eps = fast_math ? 1e-6 : 1e-12;
+
+    for (int n = 0; n < dag->len; n++) {
+        DagNode *node = &dag->nodes[n];
+        int *args = &dag->args[node->first_arg];
+        Interval a = node->arity > 0 ? ivals[args[0]] : (Interval){ 0, 0 };
+        Interval res;
+
+        switch (node->op) {
+        case OP_GET_X:
+            ivals[n] = x;
+            continue;
+        case OP_GET_Y:
+            ivals[n] = y;
+            continue;
+        case OP_RAND:
+            ivals[n] = (Interval){ node->imm, node->imm };
+            continue;
+        case OP_ID:
+            ivals[n] = a;
+            continue;
+        case OP_NEG:
+            ivals[n] = (Interval){ -a.hi, -a.lo };
+            continue;
+        case OP_SIN:
+            res = interval_sin(a);
+            break;
+        case OP_TAN:
+            res = interval_tan(a);
+            break;
+        case OP_SQRT:
+            if (a.lo < -1) {
+                res = (Interval){ -INFINITY, INFINITY };
+                break;
+            }
+            res = (Interval){ sqrt((a.lo + 1) * 2) - 1, sqrt((a.hi + 1) * 2) - 1 };
+            break;
+        case OP_ADD: {
+            Interval b = ivals[args[1]];
+            res = (Interval){ (a.lo + b.lo) / 2, (a.hi + b.hi) / 2 };
+            break;
+        }
+        case OP_MULT:
+            res = interval_mult(a, ivals[args[1]]);
+            break;
+        case OP_MIX: {
+            Interval b = ivals[args[1]], c = ivals[args[2]];
+            Interval prop = { (c.lo + 1) / 2, (c.hi + 1) / 2 };
+            Interval s = interval_mult(a, prop);
+            Interval t = interval_mult(b, (Interval){ 1 - prop.hi, 1 - prop.lo });
+            res = (Interval){ s.lo + t.lo, s.hi + t.hi };
+            break;
+        }
+        default: {
+            /* EIGHT_SUM and the like do not decrease in any argument */
+            double params_lo[MAX_ARG_NUM], params_hi[MAX_ARG_NUM];
+            for (int i = 0; i < node->arity; i++) {
+                params_lo[i] = ivals[args[i]].lo;
+                params_hi[i] = ivals[args[i]].hi;
+            }
+            res = (Interval){ kernel_func(node->op)(params_lo), kernel_func(node->op)(params_hi) };
+            break;
+        }
+        }
+
+        if (isnan(res.lo) || isnan(res.hi))
+            res = (Interval){ -INFINITY, INFINITY };
+        ivals[n] = (Interval){ res.lo - eps, res.hi + eps };
+    }
+
+    for (int c = 0; c < 3; c++)
+        out[c] = ivals[dag->roots[c]];
+}
+
+/*
+ * Tag every node with the coordinates it reads. Since x only changes with
+ * the row and y only with the column, the DEP_X and DEP_Y nodes of a plan
+ * are evaluated once per row and once per column into lookup tables, and
+ * only the DEP_MIXED nodes are left for the per-pixel loop. The frontier
+ * lists hold the hoisted nodes actually read by mixed nodes or by a root;
+ * only those are stored in the tables.
+ */
+void build_hoist_plan(Dag *dag, HoistPlan *plan)
+{
+    unsigned char *deps = (unsigned char*)malloc(dag->len);
+    unsigned char *needed = (unsigned char*)calloc(dag->len, 1);
+    int *lists = (int*)malloc(sizeof(int) * dag->len * 6);
+
+    for (int k = 0; k < 4; k++) {
+        plan->nodes[k] = lists + k * dag->len;
+        plan->nodes_len[k] = 0;
+    }
+    plan->x_frontier = lists + 4 * dag->len;
+    plan->y_frontier = lists + 5 * dag->len;
+    plan->x_frontier_len = 0;
+    plan->y_frontier_len = 0;
+
+    for (int n = 0; n < dag->len; n++) {
+        DagNode *node = &dag->nodes[n];
+        deps[n] = node->op == OP_GET_X ? DEP_X : node->op == OP_GET_Y ? DEP_Y : DEP_CONST;
+        for (int i = 0; i < node->arity; i++)
+            deps[n] |= deps[dag->args[node->first_arg + i]];
+        plan->nodes[deps[n]][plan->nodes_len[deps[n]]++] = n;
+        if (deps[n] == DEP_MIXED) {
+            for (int i = 0; i < node->arity; i++)
+                needed[dag->args[node->first_arg + i]] = 1;
+        }
+    }
+    for (int c = 0; c < 3; c++)
+        needed[dag->roots[c]] = 1;
+
+    for (int n = 0; n < dag->len; n++) {
+        if (!needed[n])
+            continue;
+        if (deps[n] == DEP_X)
+            plan->x_frontier[plan->x_frontier_len++] = n;
+        else if (deps[n] == DEP_Y)
+            plan->y_frontier[plan->y_frontier_len++] = n;
+    }
+
+    free(deps);
+    free(needed);
+}
+
+void free_hoist_plan(HoistPlan *plan)
+{
+    free(plan->nodes[0]);
+    plan->nodes[0] = NULL;
+}
+
+void build_wavefront_plan(Dag *dag, WavefrontPlan *plan)
+{
+    int *level = (int*)malloc(sizeof(int) * dag->len);
+    int *last_use = (int*)malloc(sizeof(int) * dag->len);
+    int *free_slots = (int*)malloc(sizeof(int) * dag->len);
+    int free_len = 0;
+
+    /* Arguments precede their users, so a forward sweep finds the depth */
+    plan->levels = 0;
+    for (int n = 0; n < dag->len; n++) {
+        DagNode *node = &dag->nodes[n];
+        level[n] = 0;
+        last_use[n] = -1;
+        for (int i = 0; i < node->arity; i++) {
+            int arg = dag->args[node->first_arg + i];
+            level[n] = level[arg] + 1 > level[n] ? level[arg] + 1 : level[n];
+        }
+        plan->levels = level[n] + 1 > plan->levels ? level[n] + 1 : plan->levels;
+    }
+
+    /*
+     * Then every node moves to the level just below its earliest user, so
+     * that leaves and other cheap nodes do not hold a buffer for long
+     */
+    for (int n = 0; n < dag->len; n++)
+        level[n] = plan->levels - 1;
+    for (int n = dag->len - 1; n >= 0; n--) {
+        DagNode *node = &dag->nodes[n];
+        for (int i = 0; i < node->arity; i++) {
+            int arg = dag->args[node->first_arg + i];
+            level[arg] = level[n] - 1 < level[arg] ? level[n] - 1 : level[arg];
+        }
+    }
+    for (int n = 0; n < dag->len; n++) {
+        DagNode *node = &dag->nodes[n];
+        for (int i = 0; i < node->arity; i++) {
+            int arg = dag->args[node->first_arg + i];
+            last_use[arg] = level[n] > last_use[arg] ? level[n] : last_use[arg];
+        }
+    }
+    for (int c = 0; c < 3; c++)
+        last_use[dag->roots[c]] = plan->levels;
+
+    plan->order = (int*)malloc(sizeof(int) * dag->len);
+    plan->level_start = (int*)calloc(plan->levels + 1, sizeof(int));
+    plan->slot = (int*)malloc(sizeof(int) * dag->len);
+    for (int n = 0; n < dag->len; n++)
+        plan->level_start[level[n] + 1]++;
+    for (int l = 0; l < plan->levels; l++)
+        plan->level_start[l + 1] += plan->level_start[l];
+    int *filled = (int*)calloc(dag->len, sizeof(int));
+    for (int n = 0; n < dag->len; n++)
+        plan->order[plan->level_start[level[n]] + filled[level[n]]++] = n;
+    free(filled);
+
+    /*
+     * Bucket the nodes in plan order by the level of their last reader:
+     * bucket l holds the nodes last read at level l - 1
+     */
+    int *release = (int*)malloc(sizeof(int) * dag->len);
+    int *release_start = (int*)calloc(plan->levels + 3, sizeof(int));
+    for (int n = 0; n < dag->len; n++)
+        release_start[last_use[n] + 2]++;
+    for (int l = 0; l <= plan->levels + 1; l++)
+        release_start[l + 1] += release_start[l];
+    filled = (int*)calloc(plan->levels + 2, sizeof(int));
+    for (int q = 0; q < dag->len; q++) {
+        int b = last_use[plan->order[q]] + 1;
+        release[release_start[b] + filled[b]++] = plan->order[q];
+    }
+    free(filled);
+
+    /* Slots of the previous level's last readers are released first */
+    plan->slots_cnt = 0;
+    for (int l = 0; l < plan->levels; l++) {
+        for (int r = release_start[l]; l > 0 && r < release_start[l + 1]; r++)
+            free_slots[free_len++] = plan->slot[release[r]];
+        for (int q = plan->level_start[l]; q < plan->level_start[l + 1]; q++)
+            plan->slot[plan->order[q]] = free_len > 0 ? free_slots[--free_len] : plan->slots_cnt++;
+    }
+
+    free(level);
+    free(last_use);
+    free(free_slots);
+    free(release);
+    free(release_start);
+}
+
+void free_wavefront_plan(WavefrontPlan *plan)
+{
+    free(plan->order);
+    free(plan->level_start);
+    free(plan->slot);
+    plan->order = NULL;
+    plan->level_start = NULL;
+    plan->slot = NULL;
+}
+
+void free_dag(Dag *dag)
+{
+    free(dag->nodes);
+    free(dag->args);
+    dag->nodes = NULL;
+    dag->args = NULL;
+    dag->len = 0;
+}
+
+#if defined(__x86_64__)
+static void jit_emit(JitCode *jit, const unsigned char *bytes, int n)
+{
+    memcpy(jit->buf + jit->len, bytes, n);
+    jit->len += n;
+}
+
+static void jit_emit_u32(JitCode *jit, unsigned int v)
+{
+    jit_emit(jit, (unsigned char*)&v, 4);
+}
+
+static void jit_emit_u64(JitCode *jit, unsigned long long v)
+{
+    jit_emit(jit, (unsigned char*)&v, 8);
+}
+
+/* movsd xmm<reg>, [rsp + off] (store = 0 loads, store = 1 stores) */
+static void jit_movsd_rsp(JitCode *jit, int reg, int off, int store)
+{
+    unsigned char code[] = { 0xF2, 0x0F, store ? 0x11 : 0x10, 0x84 | (reg << 3), 0x24 };
+    jit_emit(jit, code, sizeof(code));
+    jit_emit_u32(jit, off);
+}
+
+/* mov rax, imm64; movq xmm<reg>, rax */
+static void jit_load_const(JitCode *jit, int reg, double v)
+{
+    unsigned long long bits;
+    unsigned char mov_rax[] = { 0x48, 0xB8 };
+    unsigned char movq[] = { 0x66, 0x48, 0x0F, 0x6E, 0xC0 | (reg << 3) };
+    memcpy(&bits, &v, sizeof(bits));
+    jit_emit(jit, mov_rax, sizeof(mov_rax));
+    jit_emit_u64(jit, bits);
+    jit_emit(jit, movq, sizeof(movq));
+}
+
+/*
+ * The generated function keeps x, y and the evaluation stack of the
+ * program in its frame: [rsp] = x, [rsp + 8] = y, [rsp + 16 + 8 * k] =
+ * stack slot k. Cheap operations are emitted inline with scalar SSE2;
+ * everything else calls the function from func_collection with rdi
+ * pointing at its arguments, which are contiguous on the stack just as
+ * in evaluate_program.
+ */
+int jit_compile(Program progs[3], JitCode *jit)
+{
+    int max_stack = 0, total_len = 0;
+    int frame;
+
+    for (int c = 0; c < 3; c++) {
+        if (progs[c].stack_size > max_stack)
+            max_stack = progs[c].stack_size;
+        total_len += progs[c].len;
+    }
+    frame = (16 + 8 * max_stack + 15) / 16 * 16;
+
+    jit->len = 0;
+    jit->size = ((size_t)total_len * 64 + 256 + 4095) / 4096 * 4096;
+    jit->buf = mmap(NULL, jit->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->buf == MAP_FAILED) {
+        jit->buf = NULL;
+        return EXIT_FAILURE;
+    }
+
+    /* push rbx; mov rbx, rdi; sub rsp, frame; store x and y */
+    unsigned char prologue[] = { 0x53, 0x48, 0x89, 0xFB, 0x48, 0x81, 0xEC };
+    jit_emit(jit, prologue, sizeof(prologue));
+    jit_emit_u32(jit, frame);
+    jit_movsd_rsp(jit, 0, 0, 1);
+    jit_movsd_rsp(jit, 1, 8, 1);
+
+    for (int c = 0; c < 3; c++) {
+        int sp = 0;
+        for (int pc = 0; pc < progs[c].len; pc++) {
+            Instruction *ins = &progs[c].code[pc];
+            int top = 16 + 8 * (sp - 1);
+
+            switch (ins->op) {
+            case OP_GET_X:
+            case OP_GET_Y:
+                jit_movsd_rsp(jit, 0, ins->op == OP_GET_X ? 0 : 8, 0);
+                jit_movsd_rsp(jit, 0, top + 8, 1);
+                sp++;
+                break;
+            case OP_RAND:
+                jit_load_const(jit, 0, ins->imm);
+                jit_movsd_rsp(jit, 0, top + 8, 1);
+                sp++;
+                break;
+            case OP_ID:
+                break;
+            case OP_NEG: {
+                /* xorpd xmm0, xmm1 with the sign mask */
+                unsigned char xorpd[] = { 0x66, 0x0F, 0x57, 0xC1 };
+                jit_movsd_rsp(jit, 0, top, 0);
+                jit_load_const(jit, 1, -0.0);
+                jit_emit(jit, xorpd, sizeof(xorpd));
+                jit_movsd_rsp(jit, 0, top, 1);
+                break;
+            }
+            case OP_ADD:
+            case OP_MULT: {
+                /* addsd/mulsd xmm0, xmm1; halving is exact, so mulsd by 0.5 */
+                unsigned char arith[] = { 0xF2, 0x0F, ins->op == OP_ADD ? 0x58 : 0x59, 0xC1 };
+                unsigned char half[] = { 0xF2, 0x0F, 0x59, 0xC1 };
+                jit_movsd_rsp(jit, 0, top - 8, 0);
+                jit_movsd_rsp(jit, 1, top, 0);
+                jit_emit(jit, arith, sizeof(arith));
+                if (ins->op == OP_ADD) {
+                    jit_load_const(jit, 1, 0.5);
+                    jit_emit(jit, half, sizeof(half));
+                }
+                jit_movsd_rsp(jit, 0, top - 8, 1);
+                sp--;
+                break;
+            }
+            default: {
+                /* lea rdi, [rsp + off]; mov rax, func; call rax */
+                int arity = func_collection[ins->op].arity;
+                int off = top + 8 - 8 * arity;
+                unsigned char lea[] = { 0x48, 0x8D, 0xBC, 0x24 };
+                unsigned char mov_rax[] = { 0x48, 0xB8 };
+                unsigned char call[] = { 0xFF, 0xD0 };
+                jit_emit(jit, lea, sizeof(lea));
+                jit_emit_u32(jit, off);
+                jit_emit(jit, mov_rax, sizeof(mov_rax));
+                jit_emit_u64(jit, (unsigned long long)kernel_func(ins->op));
+                jit_emit(jit, call, sizeof(call));
+                jit_movsd_rsp(jit, 0, off, 1);
+                sp = sp - arity + 1;
+                break;
+            }
+            }
+        }
+
+        /* movsd [rbx + 8 * c], stack[0] */
+        unsigned char store_out[] = { 0xF2, 0x0F, 0x11, 0x43, 8 * c };
+        jit_movsd_rsp(jit, 0, 16, 0);
+        jit_emit(jit, store_out, sizeof(store_out));
+    }
+
+    /* add rsp, frame; pop rbx; ret */
+    unsigned char epilogue_add[] = { 0x48, 0x81, 0xC4 };
+    unsigned char epilogue_ret[] = { 0x5B, 0xC3 };
+    jit_emit(jit, epilogue_add, sizeof(epilogue_add));
+    jit_emit_u32(jit, frame);
+    jit_emit(jit, epilogue_ret, sizeof(epilogue_ret));
+
+    if (mprotect(jit->buf, jit->size, PROT_READ | PROT_EXEC) != 0) {
+        free_jit(jit);
+        return EXIT_FAILURE;
+    }
+    jit->func = (JitFunc)jit->buf;
+    return EXIT_SUCCESS;
+}
+#else
+int jit_compile(Program progs[3], JitCode *jit)
+{
+    jit->buf = NULL;
+    return EXIT_FAILURE;
+}
+#endif
+
+void free_jit(JitCode *jit)
+{
+    if (jit->buf)
+        munmap(jit->buf, jit->size);
+    jit->buf = NULL;
+    jit->func = NULL;
+}
+
+/* The --fast-math kernels as emitted into the generated C */
+static const char *fast_kernels_source =
+    "/* Same approximations as fast_sin_pi and fast_tan_sigmoid */\n"
+    "#define ROUND_MAGIC 6755399441055744.0\n"
+    "\n"
+    "static double rart_fast_exp(double v)\n"
+    "{\n"
+    "    double w = v * 0x1.71547652b82fep+0;\n"
+    "    double n = (w + ROUND_MAGIC) - ROUND_MAGIC;\n"
+    "    double g = (w - n) * 0x1.62e42fefa39efp-1;\n"
+    "    double p = 1 + g * (1 + g * (1.0 / 2 + g * (1.0 / 6 + g * (1.0 / 24\n"
+    "                        + g * (1.0 / 120 + g * (1.0 / 720))))));\n"
+    "    union { long long bits; double d; } scale;\n"
+    "    scale.bits = ((long long)n + 1023) << 52;\n"
+    "    return p * scale.d;\n"
+    "}\n"
+    "\n"
+    "static double rart_fast_sin(double a)\n"
+    "{\n"
+    "    double t = PI * a;\n"
+    "    double q = (t * 0x1.45f306dc9c883p-1 + ROUND_MAGIC) - ROUND_MAGIC;\n"
+    "    double r = (t - q * 1.5707963267948966) - q * 6.123233995736766e-17;\n"
+    "    double r2 = r * r;\n"
+    "    double s = r + r * r2 * (-1.0 / 6 + r2 * (1.0 / 120 + r2 * (-1.0 / 5040)));\n"
+    "    double c = 1 + r2 * (-0.5 + r2 * (1.0 / 24 + r2 * (-1.0 / 720 + r2 * (1.0 / 40320))));\n"
+    "    long long qi = (long long)q;\n"
+    "    double v = qi & 1 ? c : s;\n"
+    "    return qi & 2 ? -v : v;\n"
+    "}\n"
+    "\n"
+    "static double rart_fast_tan(double a)\n"
+    "{\n"
+    "    double t = PI * a;\n"
+    "    double q = (t * 0x1.45f306dc9c883p-1 + ROUND_MAGIC) - ROUND_MAGIC;\n"
+    "    double r = (t - q * 1.5707963267948966) - q * 6.123233995736766e-17;\n"
+    "    double r2 = r * r;\n"
+    "    double s = r + r * r2 * (-1.0 / 6 + r2 * (1.0 / 120 + r2 * (-1.0 / 5040)));\n"
+    "    double c = 1 + r2 * (-0.5 + r2 * (1.0 / 24 + r2 * (-1.0 / 720 + r2 * (1.0 / 40320))));\n"
+    "    double u = (long long)q & 1 ? -c / s : s / c;\n"
+    "    u = u > 40 ? 40 : u < -40 ? -40 : u;\n"
+    "    return 2 / (1 + rart_fast_exp(-u)) - 1;\n"
+    "}\n"
+    "\n";
+
+/*
+ * Print the programs as straight-line C: every instruction becomes one
+ * local variable, so the compiler sees the whole expression at once. The
+ * generated file exports rart_pixel() and rart_fill_rows(), the latter
+ * using the same normalization and quantization as fill_image_loop_parallel.
+ * With --fast-math, SIN and TAN call the polynomial kernels instead of libm.
+ */
+void emit_c_source(FILE *file, Program progs[3])
+{
+    fprintf(file, "/* Generated by rart; do not edit */\n");
+    fprintf(file, "#include <math.h>\n\n");
+    fprintf(file, "#define PI %.5f\n\n", PI);
+    fprintf(file, "static double eight_sum(double *nums)\n{\n");
+    fprintf(file, "    int sum = 0;\n");
+    fprintf(file, "    for (int i = 0; i < 8; i++)\n");
+    fprintf(file, "        sum += nums[i];\n");
+    fprintf(file, "    return sum;\n}\n\n");
+    if (fast_math)
+        fputs(fast_kernels_source, file);
+
+    for (int c = 0; c < 3; c++) {
+        char names[progs[c].stack_size][40];
+        int sp = 0;
+
+        fprintf(file, "static inline double rart_channel_%d(double x, double y)\n{\n", c);
+        for (int pc = 0; pc < progs[c].len; pc++) {
+            Instruction *ins = &progs[c].code[pc];
+            char *a = names[sp > 0 ? sp - 1 : 0];
+            char *b = names[sp > 1 ? sp - 2 : 0];
+            char *d = names[sp > 2 ? sp - 3 : 0];
+
+            switch (ins->op) {
+            case OP_GET_X:
+                strcpy(names[sp++], "x");
+                continue;
+            case OP_GET_Y:
+                strcpy(names[sp++], "y");
+                continue;
+            case OP_RAND:
+                /* Hexadecimal floats keep the constants exact */
+                sprintf(names[sp++], "(%a)", ins->imm);
+                continue;
+            case OP_ID:
+                continue;
+            case OP_SIN:
+                if (fast_math)
+                    fprintf(file, "    double v%d = rart_fast_sin(%s);\n", pc, a);
+                else
+                    fprintf(file, "    double v%d = sin(PI * %s);\n", pc, a);
+                break;
+            case OP_TAN:
+                if (fast_math)
+                    fprintf(file, "    double v%d = rart_fast_tan(%s);\n", pc, a);
+                else
+                    fprintf(file, "    double v%d = 1 / (1 + exp(-tan(PI * %s))) * 2 - 1;\n", pc, a);
+                break;
+            case OP_NEG:
+                fprintf(file, "    double v%d = -%s;\n", pc, a);
+                break;
+            case OP_SQRT:
+                fprintf(file, "    double v%d = sqrt((%s + 1) * 2) - 1;\n", pc, a);
+                break;
+            case OP_ADD:
+                fprintf(file, "    double v%d = (%s + %s) / 2;\n", pc, b, a);
+                sp--;
+                break;
+            case OP_MULT:
+                fprintf(file, "    double v%d = %s * %s;\n", pc, b, a);
+                sp--;
+                break;
+            case OP_MIX:
+                fprintf(file, "    double p%d = (%s + 1) / 2;\n", pc, a);
+                fprintf(file, "    double v%d = %s * p%d + %s * (1 - p%d);\n", pc, d, pc, b, pc);
+                sp -= 2;
+                break;
+            case OP_EIGHT_SUM:
+                fprintf(file, "    double v%d = eight_sum((double[8]){ ", pc);
+                for (int i = 8; i > 0; i--)
+                    fprintf(file, "%s%s", names[sp - i], i > 1 ? ", " : " });\n");
+                sp -= 7;
+                break;
+            }
+            sprintf(names[sp - 1], "v%d", pc);
+        }
+        fprintf(file, "    return %s;\n}\n\n", names[0]);
+    }
+
+    fprintf(file, "void rart_pixel(double x, double y, double out[3])\n{\n");
+    for (int c = 0; c < 3; c++)
+        fprintf(file, "    out[%d] = rart_channel_%d(x, y);\n", c, c);
+    fprintf(file, "}\n\n");
+
+    fprintf(file, "void rart_fill_rows(unsigned char *img, int width, int height, int row_begin, int row_end)\n{\n");
+    fprintf(file, "    for (int i = row_begin; i < row_end; i++) {\n");
+    fprintf(file, "        double x_norm = (double)i / (double)height * 2 - 1;\n");
+    fprintf(file, "        for (int j = 0; j < width; j++) {\n");
+    fprintf(file, "            double y_norm = (double)j / (double)width * 2 - 1;\n");
+    for (int c = 0; c < 3; c++)
+        fprintf(file, "            img[(i * width + j) * 3 + %d] = (rart_channel_%d(x_norm, y_norm) + 1) / 2 * 255;\n", c, c);
+    fprintf(file, "        }\n    }\n}\n");
+}
+
+/*
+ * The compiler runs through execvp with an argument vector, so the paths
+ * reach it verbatim whatever characters they contain
+ */
+int aot_compile(char *src_file, AotCode *aot)
+{
+    char so_file[] = "/tmp/rart-XXXXXX.so";
+    char command[] = AOT_CC;
+    char *argv[32];
+    int argc = 0, fd, status;
+    pid_t pid;
+
+    aot->handle = NULL;
+    fd = mkstemps(so_file, 3);
+    if (fd < 0) {
+        perror("Failed to create shared object file");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    for (char *arg = strtok(command, " "); arg; arg = strtok(NULL, " "))
+        argv[argc++] = arg;
+    argv[argc++] = "-o";
+    argv[argc++] = so_file;
+    argv[argc++] = src_file;
+    argv[argc++] = "-lm";
+    argv[argc] = NULL;
+
+    pid = fork();
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        perror("Failed to run the compiler");
+        _exit(127);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Compiling \"%s\" with \"%s\" failed\n", src_file, AOT_CC);
+        unlink(so_file);
+        return EXIT_FAILURE;
+    }
+
+    aot->handle = dlopen(so_file, RTLD_NOW | RTLD_LOCAL);
+    unlink(so_file);
+    if (!aot->handle) {
+        fprintf(stderr, "%s\n", dlerror());
+        return EXIT_FAILURE;
+    }
+    aot->fill = (AotFillFunc)dlsym(aot->handle, "rart_fill_rows");
+    if (!aot->fill) {
+        fprintf(stderr, "%s\n", dlerror());
+        free_aot(aot);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void free_aot(AotCode *aot)
+{
+    if (aot->handle)
+        dlclose(aot->handle);
+    aot->handle = NULL;
+    aot->fill = NULL;
+}
+
+/*
+ * Walker's alias method: column i of the table is chosen with probability
+ * alias_prob[i], otherwise its alias is. The weights are the ones a
+ * cumulative scan over prob gives: mass beyond 1 is cut off, and the mass
+ * missing to 1 goes to the last function.
+ */
+void build_alias_table(Rule *rule)
+{
+    int n = rule->func_num;
+    float weight[MAX_FUNC_NUM] = {0};
+    int small[MAX_FUNC_NUM], large[MAX_FUNC_NUM];
+    int small_cnt = 0, large_cnt = 0;
+    float acc_prob = 0;
+
+    if (n == 0)
+        return;
+    for (int i = 0; i < n; i++) {
+        float next = fminf(acc_prob + rule->sub_rules[i].prob, 1);
+        weight[i] = fmaxf(next - acc_prob, 0);
+        acc_prob = fmaxf(next, acc_prob);
+    }
+    weight[n - 1] += 1 - acc_prob;
+
+    for (int i = 0; i < n; i++) {
+        weight[i] *= n;
+        if (weight[i] < 1)
+            small[small_cnt++] = i;
+        else
+            large[large_cnt++] = i;
+    }
+    while (small_cnt > 0 && large_cnt > 0) {
+        int s = small[--small_cnt];
+        int l = large[--large_cnt];
+        rule->alias_prob[s] = weight[s];
+        rule->alias[s] = l;
+        weight[l] += weight[s] - 1;
+        if (weight[l] < 1)
+            small[small_cnt++] = l;
+        else
+            large[large_cnt++] = l;
+    }
+    /* What is left is 1 up to rounding */
+    while (large_cnt > 0) {
+        int l = large[--large_cnt];
+        rule->alias_prob[l] = 1;
+        rule->alias[l] = l;
+    }
+    while (small_cnt > 0) {
+        int s = small[--small_cnt];
+        rule->alias_prob[s] = 1;
+        rule->alias[s] = s;
+    }
+}
+
+/* One draw picks a column and a side of it, whatever the number of functions */
+int rand_with_weight(Rule *rule, Rng *rng)
+{
+    double u = rng_uniform(rng) * rule->func_num;
+    int i = (int)u;
+
+    return u - i < rule->alias_prob[i] ? i : rule->alias[i];
+}
+
+void func_info_cpy(FuncInfo *dest, FuncInfo *source)
+{
+    dest->func = source->func;
+    dest->arity = source->arity;
+    strcpy(dest->func_name, source->func_name);
+    dest->op = source->op;
+}
+
+char *get_real_line(char *buffer, int buffer_size, FILE *file)
+{
+    char *res;
+    char *buffer_cpy = (char*)malloc(sizeof(char) * buffer_size);
+    while ((res = fgets(buffer, buffer_size, file))) {
+        char *first_char;
+        strcpy(buffer_cpy, buffer);
+        first_char = strtok(buffer_cpy, " \t\n");
+        if (first_char && first_char[0] != '#') {
+            break;
+        }
+    }
+    free(buffer_cpy);
+    return res;
+}
+
+int find_symbol(char *symbol, char symbol_arr[MAX_RULE_NUM][MAX_SYMBOL_LEN + 1], int symbol_arr_size)
+{
+    for (int i = 0; i < symbol_arr_size; i++) {
+        if (strcmp(symbol, symbol_arr[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int find_func(char *func_name)
+{
+    int i = 0; 
+    for (; i < sizeof(func_collection) / sizeof(FuncInfo); i++) {
+        if (strcmp(func_name, func_collection[i].func_name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int find_engine(char *engine_name)
+{
+    int i = 0;
+    for (; i < sizeof(engine_names) / sizeof(char*); i++) {
+        if (strcmp(engine_name, engine_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int parse_from_file(char *file_name, int entry_symbol_arr[3], Rule grammar[MAX_RULE_NUM])
+{
+    FILE *file = fopen(file_name, "r");
+    char line_buffer[1024];
+
+    if (file == NULL) {
+        fprintf(stderr, "Error opening file %s\n", file_name);
+        return EXIT_FAILURE;
+    }
+
+    /* Get defined symbols */
+    char symbol_arr[MAX_RULE_NUM][MAX_SYMBOL_LEN + 1];
+    char *symbol;
+    int symbol_pos;
+    int symbol_arr_size = 0;
+
+    if (!get_real_line(line_buffer, sizeof(line_buffer), file)) {
+        perror("Symbol definitions expected\n");
+        return EXIT_FAILURE;
+    }
+    symbol = strtok(line_buffer, " \t\n");
+    while (symbol) {
+        if (strlen(symbol) > MAX_SYMBOL_LEN) {
+            fprintf(stderr, 
+                    "The name \"%s\" exceeds the maximum length of %d characters\n",
+                    symbol, MAX_SYMBOL_LEN);
+            return EXIT_FAILURE;
+        }
+        strcpy(symbol_arr[symbol_arr_size++], symbol);
+        symbol = strtok(NULL, " \t\n");
+    }
+
+    /* Get entry symbols */
+    int entry_symbol_arr_size = 0;
+
+    if (!get_real_line(line_buffer, sizeof(line_buffer), file)) {
+        perror("Entry symbols expected\n");
+        return EXIT_FAILURE;
+    }
+    symbol = strtok(line_buffer, " \t\n");
+    while (symbol) {
+        if (entry_symbol_arr_size > 3) {
+            fprintf(stderr, "Too many entry symbols; 3 entry symbols are expected (RGB)\n");
+            return EXIT_FAILURE;
+        }
+        symbol_pos = find_symbol(symbol, symbol_arr, symbol_arr_size);
+        if (symbol_pos < 0) {
+            fprintf(stderr, "Symbol \"%s\" is not defined\n", symbol);
+            return EXIT_FAILURE;
+        }
+        entry_symbol_arr[entry_symbol_arr_size++] = symbol_pos;
+        symbol = strtok(NULL, " \t\n");
+    }
+    if (entry_symbol_arr_size < 3) {
+        fprintf(stderr, "3 entry symbols are expected (RGB); only got %d\n", entry_symbol_arr_size);
+        return EXIT_FAILURE;
+    }
+
+    /* Get the rules */
+    while (get_real_line(line_buffer, sizeof(line_buffer), file)) {
+        char *arrow;
+        int master_pos;
+        int func_cnt = 0;
+
+        symbol = strtok(line_buffer, " \t\n");
+        symbol_pos = find_symbol(symbol, symbol_arr, symbol_arr_size);
+        if (symbol_pos < 0) {
+            fprintf(stderr, "Symbol \"%s\" is not defined\n", symbol);
+            return EXIT_FAILURE;
+        }
+        master_pos = symbol_pos;
+        arrow = strtok(NULL, " \t\n");
+        if (strcmp(arrow, "->") != 0) {
+            fprintf(stderr, "-> is expected to define a rule\n");
+            return EXIT_FAILURE;
+        }
+
+        while (1) {
+            char *prob;
+            char *func_name;
+            int arity = 0;
+            int func_pos;
+            prob = strtok(NULL, " \t\n");
+            if (!atof(prob)) {
+                fprintf(stderr, "Float for probability is expected, got \"%s\"\n", prob);
+                return EXIT_FAILURE;
+            }
+            grammar[master_pos].sub_rules[func_cnt].prob = atof(prob);
+            func_name = strtok(NULL, " \t\n");
+            func_pos = find_func(func_name);
+            if (func_pos < 0) {
+                fprintf(stderr, "Function \"%s\" is not valid\n", func_name);
+                return EXIT_FAILURE;
+            }
+            func_info_cpy(&grammar[master_pos].sub_rules[func_cnt].func_info, &func_collection[func_pos]);
+            while (1) {
+                symbol = strtok(NULL, " \t\n");
+                if (!symbol || strcmp(symbol, "|") == 0)
+                    break;
+                symbol_pos = find_symbol(symbol, symbol_arr, symbol_arr_size);
+                if (symbol_pos < 0) {
+                    fprintf(stderr, "Symbol \"%s\" is not defined\n", symbol);
+                }
+                grammar[master_pos].sub_rules[func_cnt].args[arity++] = symbol_pos;
+            }
+            if (arity != grammar[master_pos].sub_rules[func_cnt].func_info.arity) {
+                fprintf(stderr, "%s expect %d arguments; got %d\n", 
+                        grammar[master_pos].sub_rules[func_cnt].func_info.func_name,
+                        grammar[master_pos].sub_rules[func_cnt].func_info.arity,
+                        arity);
+                return EXIT_FAILURE;
+            }
+            func_cnt++;
+            if (!symbol)
+                break;
+        }
+        grammar[master_pos].func_num = func_cnt;
+        build_alias_table(&grammar[master_pos]);
+    }
+
+
+    fclose(file);
+
+    return EXIT_SUCCESS;
+}
+
+/* Physical package of a CPU according to sysfs, 0 when unknown */
+static int cpu_package(int cpu)
+{
+    char path[96];
+    int package = 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+    FILE *file = fopen(path, "r");
+    if (file) {
+        if (fscanf(file, "%d", &package) != 1)
+            package = 0;
+        fclose(file);
+    }
+    return package;
+}
+
+/*
+ * Bind every thread of a team of threads_cnt to one CPU of the process
+ * affinity mask. OpenMP keeps the threads of a team size alive, so the
+ * binding holds for the following parallel regions. Returns 0 on failure.
+ */
+int pin_threads(int threads_cnt, int mode)
+{
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE], cpus_cnt = 0, ok = 1;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed))
+            cpus[cpus_cnt++] = cpu;
+    }
+
+    if (mode == PIN_SCATTER) {
+        /* Order by rank inside the package, then by package */
+        int packages[CPU_SETSIZE], ranks[CPU_SETSIZE], sorted[CPU_SETSIZE];
+        for (int k = 0; k < cpus_cnt; k++) {
+            packages[k] = cpu_package(cpus[k]);
+            ranks[k] = 0;
+            for (int m = 0; m < k; m++)
+                ranks[k] += packages[m] == packages[k];
+        }
+        for (int k = 0, len = 0; len < cpus_cnt; k++) {
+            for (int m = 0; m < cpus_cnt; m++) {
+                if (ranks[m] == k)
+                    sorted[len++] = cpus[m];
+            }
+        }
+        memcpy(cpus, sorted, sizeof(int) * cpus_cnt);
+    }
+
+#   pragma omp parallel num_threads(threads_cnt) reduction(&&:ok)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[omp_get_thread_num() % cpus_cnt], &set);
+        ok = sched_setaffinity(0, sizeof(set), &set) == 0;
+    }
+    return ok;
+}
+
+/* Record the CPU and NUMA node every thread of the team runs on */
+void init_numa_layout(int threads_cnt)
+{
+    numa.threads_cnt = threads_cnt;
+    numa.thread_cpu = (int*)malloc(sizeof(int) * threads_cnt);
+    numa.thread_node = (int*)malloc(sizeof(int) * threads_cnt);
+    numa.thread_touched = (long*)calloc(threads_cnt, sizeof(long));
+    numa.thread_pixels = (long*)calloc(threads_cnt, sizeof(long));
+    numa.thread_time = (double*)calloc(threads_cnt, sizeof(double));
+    numa.nodes_cnt = 1;
+
+#   pragma omp parallel num_threads(threads_cnt)
+    {
+        unsigned cpu = 0, node = 0;
+        getcpu(&cpu, &node);
+        numa.thread_cpu[omp_get_thread_num()] = cpu;
+        numa.thread_node[omp_get_thread_num()] = node;
+    }
+    for (int t = 0; t < threads_cnt; t++) {
+        if (numa.thread_node[t] + 1 > numa.nodes_cnt)
+            numa.nodes_cnt = numa.thread_node[t] + 1;
+    }
+}
+
+/*
+ * Zero the image with the loop shape and schedule of the renderer, so that
+ * the kernel places each page on the node of the thread that will write it.
+ * The placement is exact for static schedules; dynamic and guided ones, and
+ * the engines that deal out tiles, have no fixed owner for a pixel.
+ */
+void first_touch_image(unsigned char *img, int width, int height, int shape)
+{
+    int seg_cnt = (width + TILE_WIDTH - 1) / TILE_WIDTH;
+
+#   pragma omp parallel num_threads(numa.threads_cnt)
+    {
+        long touched = 0;
+
+        if (shape == TOUCH_PIXELS) {
+#           pragma omp for collapse(2) schedule(runtime)
+            for (int i = 0; i < height; i++) {
+                for (int j = 0; j < width; j++) {
+                    memset(&img[((long)i * width + j) * 3], 0, 3);
+                    touched++;
+                }
+            }
+        }
+        else if (shape == TOUCH_SEGMENTS) {
+#           pragma omp for collapse(2) schedule(runtime)
+            for (int i = 0; i < height; i++) {
+                for (int s = 0; s < seg_cnt; s++) {
+                    int j0 = s * TILE_WIDTH;
+                    int n = width - j0 < TILE_WIDTH ? width - j0 : TILE_WIDTH;
+                    memset(&img[((long)i * width + j0) * 3], 0, n * 3);
+                    touched += n;
+                }
+            }
+        }
+        else {
+#           pragma omp for schedule(static)
+            for (int i = 0; i < height; i++) {
+                memset(&img[(long)i * width * 3], 0, (long)width * 3);
+                touched += width;
+            }
+        }
+        numa.thread_touched[omp_get_thread_num()] = touched;
+    }
+}
+
+/* Add the busy time since start and the pixels of the calling thread to the layout */
+static void numa_record(double start, long pixels)
+{
+    int t = omp_get_thread_num();
+    if (numa.thread_time && t < numa.threads_cnt) {
+        numa.thread_time[t] += omp_get_wtime() - start;
+        numa.thread_pixels[t] += pixels;
+    }
+}
+
+/* The first thread of each node copies the arena of the trees into memory it touches */
+void replicate_trees(Arena *arena, ExpressionNode *roots[3])
+{
+    numa.trees = calloc(numa.nodes_cnt, sizeof(*numa.trees));
+    numa.tree_blocks = calloc(numa.nodes_cnt, sizeof(char*));
+    memcpy(numa.trees_src, roots, sizeof(numa.trees_src));
+
+#   pragma omp parallel num_threads(numa.threads_cnt)
+    {
+        int t = omp_get_thread_num(), node = numa.thread_node[t], first = 1;
+        for (int u = 0; u < t; u++)
+            first &= numa.thread_node[u] != node;
+        if (first) {
+            numa.tree_blocks[node] = (char*)malloc(arena->len);
+            memcpy(numa.tree_blocks[node], arena->base, arena->len);
+            for (int c = 0; c < 3; c++)
+                numa.trees[node][c] = (ExpressionNode*)(numa.tree_blocks[node] + ((char*)roots[c] - arena->base));
+        }
+    }
+}
+
+void replicate_programs(Program progs[3])
+{
+    numa.progs = calloc(numa.nodes_cnt, sizeof(*numa.progs));
+    numa.progs_src = progs;
+
+#   pragma omp parallel num_threads(numa.threads_cnt)
+    {
+        int t = omp_get_thread_num(), node = numa.thread_node[t], first = 1;
+        for (int u = 0; u < t; u++)
+            first &= numa.thread_node[u] != node;
+        for (int c = 0; c < 3 && first; c++) {
+            numa.progs[node][c] = progs[c];
+            numa.progs[node][c].code = malloc(sizeof(Instruction) * progs[c].len);
+            memcpy(numa.progs[node][c].code, progs[c].code, sizeof(Instruction) * progs[c].len);
+        }
+    }
+}
+
+/* The copy of roots (or progs) on the node of the calling thread, if any */
+static void numa_local_trees(ExpressionNode *roots[3])
+{
+    int t = omp_get_thread_num();
+    if (numa.trees && t < numa.threads_cnt && memcmp(roots, numa.trees_src, sizeof(numa.trees_src)) == 0)
+        memcpy(roots, numa.trees[numa.thread_node[t]], sizeof(numa.trees_src));
+}
+
+static Program *numa_local_programs(Program progs[3])
+{
+    int t = omp_get_thread_num();
+    if (numa.progs && t < numa.threads_cnt && progs == numa.progs_src)
+        return numa.progs[numa.thread_node[t]];
+    return progs;
+}
+
+void report_numa_layout(void)
+{
+    for (int node = 0; node < numa.nodes_cnt; node++) {
+        int threads = 0;
+        long touched = 0;
+        for (int t = 0; t < numa.threads_cnt; t++) {
+            threads += numa.thread_node[t] == node;
+            touched += numa.thread_node[t] == node ? numa.thread_touched[t] : 0;
+        }
+        if (threads == 0)
+            continue;
+        printf("NUMA node %d: %d threads on CPUs", node, threads);
+        for (int t = 0; t < numa.threads_cnt; t++) {
+            if (numa.thread_node[t] == node)
+                printf(" %d", numa.thread_cpu[t]);
+        }
+        printf(", %ld image pixels first touched%s\n", touched,
+                numa.trees || numa.progs ? ", local replica of the trees or programs" : "");
+    }
+}
+
+/*
+ * Pixels and busy time of every node, for the engines that record them;
+ * the throughput is over the busiest thread of the node
+ */
+void report_numa_throughput(void)
+{
+    for (int node = 0; node < numa.nodes_cnt; node++) {
+        long pixels = 0;
+        double busiest = 0;
+        for (int t = 0; t < numa.threads_cnt; t++) {
+            if (numa.thread_node[t] != node)
+                continue;
+            pixels += numa.thread_pixels[t];
+            busiest = numa.thread_time[t] > busiest ? numa.thread_time[t] : busiest;
+        }
+        if (pixels == 0)
+            continue;
+        printf("NUMA node %d: rendered %ld pixels in %.4f s (%.2f Mpixel/s)\n", node, pixels,
+                busiest, busiest > 0 ? pixels / busiest / 1e6 : 0);
+    }
+}
+
+void free_numa_layout(void)
+{
+    for (int node = 0; numa.tree_blocks && node < numa.nodes_cnt; node++)
+        free(numa.tree_blocks[node]);
+    free(numa.tree_blocks);
+    for (int node = 0; numa.progs && node < numa.nodes_cnt; node++) {
+        for (int c = 0; c < 3; c++)
+            free(numa.progs[node][c].code);
+    }
+    free(numa.trees);
+    free(numa.progs);
+    free(numa.thread_cpu);
+    free(numa.thread_node);
+    free(numa.thread_touched);
+    free(numa.thread_pixels);
+    free(numa.thread_time);
+    memset(&numa, 0, sizeof(numa));
+}
+
+void init_steal_pool(StealPool *pool, int workers_cnt, StealFunc run, void *data)
+{
+    pool->deques = aligned_alloc(64, sizeof(StealDeque) * workers_cnt);
+    pool->workers_cnt = workers_cnt;
+    atomic_init(&pool->pending, 0);
+    pool->run = run;
+    pool->data = data;
+
+    for (int w = 0; w < workers_cnt; w++) {
+        StealDeque *d = &pool->deques[w];
+        atomic_init(&d->top, 0);
+        atomic_init(&d->bottom, 0);
+        d->items = malloc(sizeof(long) * STEAL_DEQUE_SIZE);
+        d->executed = d->steals = d->idle = 0;
+    }
+}
+
+/* Owner side; a task that does not fit in a full deque runs right away */
+void steal_push(StealPool *pool, int worker, long task)
+{
+    StealDeque *d = &pool->deques[worker];
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+
+    if (b - t >= STEAL_DEQUE_SIZE) {
+        d->executed++;
+        pool->run(pool, worker, task, pool->data);
+        return;
+    }
+    atomic_fetch_add_explicit(&pool->pending, 1, memory_order_relaxed);
+    atomic_store_explicit(&d->items[b % STEAL_DEQUE_SIZE], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+/* Owner side; returns 0 when the deque is empty */
+static int steal_take(StealDeque *d, long *task)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (t > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return 0;
+    }
+    *task = atomic_load_explicit(&d->items[b % STEAL_DEQUE_SIZE], memory_order_relaxed);
+    if (t == b) {
+        /* Last task: race the thieves for it */
+        int won = atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return won;
+    }
+    return 1;
+}
+
+/* Thief side; returns 0 when the deque is empty or another thief won */
+static int steal_from(StealDeque *d, long *task)
+{
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+
+    if (t >= b)
+        return 0;
+    *task = atomic_load_explicit(&d->items[t % STEAL_DEQUE_SIZE], memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed);
+}
+
+/*
+ * Called by every thread of a parallel region, the thread number being the
+ * worker. A worker runs its own tasks newest first and, when out of work,
+ * steals the oldest task of a random victim until no task is pending.
+ */
+void steal_run(StealPool *pool)
+{
+    int worker = omp_get_thread_num();
+    StealDeque *d = &pool->deques[worker];
+    unsigned seed = worker + 1;
+    long task;
+
+    while (atomic_load_explicit(&pool->pending, memory_order_acquire) > 0) {
+        int found = steal_take(d, &task);
+        if (!found && pool->workers_cnt > 1) {
+            int victim = rand_r(&seed) % (pool->workers_cnt - 1);
+            victim += victim >= worker;
+            found = steal_from(&pool->deques[victim], &task);
+            d->steals += found;
+        }
+        if (!found) {
+            d->idle++;
+            sched_yield();
+            continue;
+        }
+        pool->run(pool, worker, task, pool->data);
+        d->executed++;
+        atomic_fetch_sub_explicit(&pool->pending, 1, memory_order_release);
+    }
+}
+
+void report_steal_stats(StealPool *pool)
+{
+    long executed = 0, steals = 0, idle = 0;
+
+    for (int w = 0; w < pool->workers_cnt; w++) {
+        StealDeque *d = &pool->deques[w];
+        printf("Worker %d: %ld tasks, %ld stolen, %ld idle polls\n", w, d->executed, d->steals, d->idle);
+        executed += d->executed;
+        steals += d->steals;
+        idle += d->idle;
+    }
+    printf("Work stealing ran %ld tasks, %ld of them stolen, with %ld idle polls\n",
+            executed, steals, idle);
+}
+
+void free_steal_pool(StealPool *pool)
+{
+    if (pool->deques == NULL)
+        return;
+    for (int w = 0; w < pool->workers_cnt; w++)
+        free(pool->deques[w].items);
+    free(pool->deques);
+    pool->deques = NULL;
+}
+
+void fill_image_loop_parallel(unsigned char *img, int width, int height,
+        ExpressionNode *r_root, ExpressionNode *g_root, ExpressionNode *b_root,
+        int threads_cnt)
+{
+#   pragma omp parallel num_threads(threads_cnt)
+    {
+        ExpressionNode *roots[3] = { r_root, g_root, b_root };
+        double start = omp_get_wtime();
+        long pixels = 0;
+        numa_local_trees(roots);
+
+#       pragma omp for collapse(2) schedule(runtime) nowait
+        for (int i = 0; i < height; i++) {
+            for (int j = 0; j < width; j++) {
+                int idx = (i * width + j) * 3;
+                double x_norm = (double)i / (double)height * 2 - 1;
+                double y_norm = (double)j / (double)width * 2 - 1;
+                img[idx + 0] = (evaluate_expression_tree(roots[0], x_norm, y_norm, 0) + 1) / 2 * 255;
+                img[idx + 1] = (evaluate_expression_tree(roots[1], x_norm, y_norm, 0) + 1) / 2 * 255;
+                img[idx + 2] = (evaluate_expression_tree(roots[2], x_norm, y_norm, 0) + 1) / 2 * 255;
+                pixels++;
+            }
+        }
+        numa_record(start, pixels);
+    }
+}
+
+/* Node states of the tree contraction */
+enum {
+    CONTRACT_OPEN,      /* more than one argument is pending */
+    CONTRACT_CHAIN,     /* value is coef_a * value of next + coef_b */
+    CONTRACT_DONE,
+};
+
+/*
+ * RAKE: evaluate node n over the lanes once all of its arguments are known.
+ * The arguments are copied into consecutive slots of the scratch stack, so
+ * the vector kernels of the tile engines apply as is.
+ */
+static void contract_rake(Dag *dag, int n, double *xs, double *ys, int lanes, int stride,
+        double *vals, double *scratch)
+{
+    DagNode *node = &dag->nodes[n];
+    int *args = &dag->args[node->first_arg];
+    Instruction ins = { node->op, node->imm };
+
+    for (int i = 0; i < node->arity; i++)
+        memcpy(&scratch[i * stride], &vals[(long)args[i] * stride], sizeof(double) * lanes);
+    execute_tile_instruction(&ins, scratch, stride, node->arity, xs, ys, lanes);
+    memcpy(&vals[(long)n * stride], scratch, sizeof(double) * lanes);
+}
+
+/*
+ * COMPRESS: write node n as a * x + b, where x is its only pending argument
+ * args[pos]. Returns 0 for the operations that are not affine in x.
+ */
+static int contract_compress(Dag *dag, int n, int pos, int lanes, int stride, double *vals,
+        double *a, double *b)
+{
+    DagNode *node = &dag->nodes[n];
+    int *args = &dag->args[node->first_arg];
+
+    if (node->op != OP_ID && node->op != OP_NEG && node->op != OP_ADD
+            && node->op != OP_MULT && node->op != OP_MIX)
+        return 0;
+
+    for (int k = 0; k < lanes; k++) {
+        double v[3];
+        for (int i = 0; i < node->arity; i++)
+            v[i] = i == pos ? 0 : vals[(long)args[i] * stride + k];
+
+        switch (node->op) {
+        case OP_ID:
+            a[k] = 1;
+            b[k] = 0;
+            break;
+        case OP_NEG:
+            a[k] = -1;
+            b[k] = 0;
+            break;
+        case OP_ADD:
+            a[k] = 0.5;
+            b[k] = v[1 - pos] / 2;
+            break;
+        case OP_MULT:
+            a[k] = v[1 - pos];
+            b[k] = 0;
+            break;
+        case OP_MIX:
+            if (pos == 2) {
+                a[k] = (v[0] - v[1]) / 2;
+                b[k] = (v[0] + v[1]) / 2;
+            }
+            else {
+                double prop = (v[2] + 1) / 2;
+                a[k] = pos == 0 ? prop : 1 - prop;
+                b[k] = pos == 0 ? v[1] * (1 - prop) : v[0] * prop;
+            }
+            break;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Pixels per contraction batch: an even share of the image per thread, so
+ * that the synchronization of a round is paid as few times as possible,
+ * but no more than the values and the two buffers of coefficients of every
+ * node fit in half of the last-level cache
+ */
+static int contract_batch_lanes(Dag *dag, long pixels, int threads_cnt)
+{
+    long cache = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    long lanes = (pixels + threads_cnt - 1) / threads_cnt;
+
+    if (cache <= 0)
+        cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (cache <= 0)
+        cache = 1 << 20;
+    long fit = cache / 2 / (5 * sizeof(double) * dag->len);
+    if (lanes > fit)
+        lanes = fit;
+    /* Whole SIMD vectors, and enough lanes to amortize a round */
+    lanes = lanes / 8 * 8;
+    return lanes < CONTRACT_MIN_LANES ? CONTRACT_MIN_LANES : lanes;
+}
+
+/*
+ * Parallel tree contraction over the merged graph, one batch of pixels at a
+ * time (see contract_batch_lanes). In every round each pending node either
+ * rakes (all arguments known), compresses into an affine function of its
+ * only pending argument, or, when already compressed, jumps over a
+ * compressed argument so that chains shrink by half per round. The state of
+ * a round is double buffered and the pending nodes are compacted between
+ * rounds, so a round costs O(pending / P) and two barriers; every thread
+ * sums the compacted length itself instead of waiting on a single.
+ * Returns the number of rounds of the last batch and its size in *batch.
+ *
+ * SIN, TAN, SQRT and EIGHT_SUM only rake, and compressed chains compose
+ * their coefficients, so results may differ from the tree engine in the
+ * last bits.
+ */
+int fill_image_contract(unsigned char *img, int width, int height,
+        Dag *dag, int threads_cnt, int *batch)
+{
+    long pixels = (long)width * height;
+    int len = dag->len, stride = contract_batch_lanes(dag, pixels, threads_cnt);
+    long lanes_len = (long)len * stride;
+    double *vals = malloc(sizeof(double) * lanes_len);
+    double *coef_a[2], *coef_b[2];
+    int *next[2], *pending[2];
+    unsigned char *state[2];
+    int *counts = malloc(sizeof(int) * (threads_cnt + 1));
+    double *xs = malloc(sizeof(double) * stride);
+    double *ys = malloc(sizeof(double) * stride);
+    int rounds = 0;
+
+    for (int b = 0; b < 2; b++) {
+        coef_a[b] = malloc(sizeof(double) * lanes_len);
+        coef_b[b] = malloc(sizeof(double) * lanes_len);
+        next[b] = malloc(sizeof(int) * len);
+        pending[b] = malloc(sizeof(int) * len);
+        state[b] = malloc(len);
+    }
+
+#   pragma omp parallel num_threads(threads_cnt) reduction(max:rounds)
+    {
+        int tid = omp_get_thread_num();
+        int *local = malloc(sizeof(int) * len);
+        double *scratch = malloc(sizeof(double) * MAX_ARG_NUM * stride);
+
+        for (long p0 = 0; p0 < pixels; p0 += stride) {
+            int lanes = pixels - p0 < stride ? pixels - p0 : stride;
+            int pending_len = len, cur = 0;
+
+            rounds = 0;
+#           pragma omp for nowait
+            for (int k = 0; k < lanes; k++) {
+                xs[k] = (double)((p0 + k) / width) / (double)height * 2 - 1;
+                ys[k] = (double)((p0 + k) % width) / (double)width * 2 - 1;
+            }
+#           pragma omp for
+            for (int n = 0; n < len; n++) {
+                state[0][n] = CONTRACT_OPEN;
+                pending[0][n] = n;
+            }
+
+            while (pending_len > 0) {
+                int c = cur, w = 1 - cur, local_len = 0;
+
+#               pragma omp for schedule(dynamic, 16) nowait
+                for (int p = 0; p < pending_len; p++) {
+                    int n = pending[c][p];
+                    double *a = &coef_a[c][(long)n * stride], *b = &coef_b[c][(long)n * stride];
+                    double *wa = &coef_a[w][(long)n * stride], *wb = &coef_b[w][(long)n * stride];
+
+                    if (state[c][n] == CONTRACT_DONE) {
+                        /* both buffers must agree before n leaves the list */
+                        state[w][n] = CONTRACT_DONE;
+                        continue;
+                    }
+                    if (state[c][n] == CONTRACT_CHAIN) {
+                        int t = next[c][n];
+                        double *ta = &coef_a[c][(long)t * stride], *tb = &coef_b[c][(long)t * stride];
+
+                        if (state[c][t] == CONTRACT_DONE) {
+                            double *d = &vals[(long)n * stride], *tv = &vals[(long)t * stride];
+#                           pragma omp simd
+                            for (int k = 0; k < lanes; k++)
+                                d[k] = a[k] * tv[k] + b[k];
+                            state[w][n] = CONTRACT_DONE;
+                        }
+                        else if (state[c][t] == CONTRACT_CHAIN) {
+#                           pragma omp simd
+                            for (int k = 0; k < lanes; k++) {
+                                wa[k] = a[k] * ta[k];
+                                wb[k] = a[k] * tb[k] + b[k];
+                            }
+                            next[w][n] = next[c][t];
+                            state[w][n] = CONTRACT_CHAIN;
+                        }
+                        else {
+                            memcpy(wa, a, sizeof(double) * lanes);
+                            memcpy(wb, b, sizeof(double) * lanes);
+                            next[w][n] = t;
+                            state[w][n] = CONTRACT_CHAIN;
+                        }
+                    }
+                    else {
+                        DagNode *node = &dag->nodes[n];
+                        int *args = &dag->args[node->first_arg];
+                        int waiting = 0, pos = 0;
+
+                        for (int i = 0; i < node->arity; i++) {
+                            if (state[c][args[i]] != CONTRACT_DONE) {
+                                waiting++;
+                                pos = i;
+                            }
+                        }
+                        if (waiting == 0) {
+                            contract_rake(dag, n, xs, ys, lanes, stride, vals, scratch);
+                            state[w][n] = CONTRACT_DONE;
+                        }
+                        else if (waiting == 1
+                                && contract_compress(dag, n, pos, lanes, stride, vals, wa, wb)) {
+                            next[w][n] = args[pos];
+                            state[w][n] = CONTRACT_CHAIN;
+                        }
+                        else {
+                            state[w][n] = CONTRACT_OPEN;
+                        }
+                    }
+                    local[local_len++] = n;
+                }
+
+                counts[tid + 1] = local_len;
+#               pragma omp barrier
+                int offset = 0;
+                pending_len = 0;
+                for (int t = 1; t <= omp_get_num_threads(); t++) {
+                    offset += t <= tid ? counts[t] : 0;
+                    pending_len += counts[t];
+                }
+                memcpy(&pending[w][offset], local, sizeof(int) * local_len);
+                cur = w;
+                rounds++;
+#               pragma omp barrier
+            }
+
+#           pragma omp for
+            for (int k = 0; k < lanes; k++) {
+                for (int c = 0; c < 3; c++)
+                    img[(p0 + k) * 3 + c] = (vals[(long)dag->roots[c] * stride + k] + 1) / 2 * 255;
+            }
+        }
+
+        free(local);
+        free(scratch);
+    }
+
+    for (int b = 0; b < 2; b++) {
+        free(coef_a[b]);
+        free(coef_b[b]);
+        free(next[b]);
+        free(pending[b]);
+        free(state[b]);
+    }
+    free(counts);
+    free(vals);
+    free(xs);
+    free(ys);
+
+    *batch = stride;
+    return rounds;
+}
+
+void fill_image_bytecode(unsigned char *img, int width, int height,
+        Program progs[3], int threads_cnt)
+{
+#   pragma omp parallel num_threads(threads_cnt)
+    {
+        Program *local = numa_local_programs(progs);
+        double start = omp_get_wtime();
+        long pixels = 0;
+
+#       pragma omp for collapse(2) schedule(runtime) nowait
+        for (int i = 0; i < height; i++) {
+            for (int j = 0; j < width; j++) {
+                int idx = (i * width + j) * 3;
+                double x_norm = (double)i / (double)height * 2 - 1;
+                double y_norm = (double)j / (double)width * 2 - 1;
+                pixels++;
+                if (use_float) {
+                    for (int c = 0; c < 3; c++)
+                        img[idx + c] = (evaluate_program_float(&local[c], x_norm, y_norm) + 1) / 2 * 255;
+                    continue;
+                }
+                img[idx + 0] = (evaluate_program(&local[0], x_norm, y_norm) + 1) / 2 * 255;
+                img[idx + 1] = (evaluate_program(&local[1], x_norm, y_norm) + 1) / 2 * 255;
+                img[idx + 2] = (evaluate_program(&local[2], x_norm, y_norm) + 1) / 2 * 255;
+            }
+        }
+        numa_record(start, pixels);
+    }
+}
+
+void fill_image_simd(unsigned char *img, int width, int height,
+        Program progs[3], int threads_cnt)
+{
+    int seg_cnt = (width + TILE_WIDTH - 1) / TILE_WIDTH;
+
+#   pragma omp parallel num_threads(threads_cnt)
+    {
+        Program *local = numa_local_programs(progs);
+        double start = omp_get_wtime();
+        long pixels = 0;
+
+#       pragma omp for collapse(2) schedule(runtime) nowait
+        for (int i = 0; i < height; i++) {
+            for (int s = 0; s < seg_cnt; s++) {
+                double xs[TILE_WIDTH], ys[TILE_WIDTH], vals[TILE_WIDTH];
+                int j0 = s * TILE_WIDTH;
+                int n = width - j0 < TILE_WIDTH ? width - j0 : TILE_WIDTH;
+                pixels += n;
+
+                for (int k = 0; k < n; k++) {
+                    xs[k] = (double)i / (double)height * 2 - 1;
+                    ys[k] = (double)(j0 + k) / (double)width * 2 - 1;
+                }
+                if (use_float) {
+                    float xs_f[TILE_WIDTH], ys_f[TILE_WIDTH], vals_f[TILE_WIDTH];
+                    for (int k = 0; k < n; k++) {
+                        xs_f[k] = xs[k];
+                        ys_f[k] = ys[k];
+                    }
+                    for (int c = 0; c < 3; c++) {
+                        evaluate_program_tile_float(&local[c], xs_f, ys_f, n, vals_f);
+                        for (int k = 0; k < n; k++)
+                            img[(i * width + j0 + k) * 3 + c] = (vals_f[k] + 1) / 2 * 255;
+                    }
+                    continue;
+                }
+                for (int c = 0; c < 3; c++) {
+                    evaluate_program_tile(&local[c], xs, ys, n, vals);
+                    for (int k = 0; k < n; k++)
+                        img[(i * width + j0 + k) * 3 + c] = (vals[k] + 1) / 2 * 255;
+                }
+            }
+        }
+        numa_record(start, pixels);
+    }
+}
+
+void fill_image_fused(unsigned char *img, int width, int height,
+        Program *fused, int threads_cnt)
+{
+    int seg_cnt = (width + TILE_WIDTH - 1) / TILE_WIDTH;
+
+#   pragma omp parallel num_threads(threads_cnt)
+    {
+        double start = omp_get_wtime();
+        long pixels = 0;
+
+#       pragma omp for collapse(2) schedule(runtime) nowait
+        for (int i = 0; i < height; i++) {
+            for (int s = 0; s < seg_cnt; s++) {
+                double xs[TILE_WIDTH], ys[TILE_WIDTH];
+                double stack[fused->stack_size * TILE_WIDTH];
+                int j0 = s * TILE_WIDTH;
+                int n = width - j0 < TILE_WIDTH ? width - j0 : TILE_WIDTH;
+
+                for (int k = 0; k < n; k++) {
+                    xs[k] = (double)i / (double)height * 2 - 1;
+                    ys[k] = (double)(j0 + k) / (double)width * 2 - 1;
+                }
+                evaluate_fused_tile(fused, stack, TILE_WIDTH, xs, ys, n, &img[(i * width + j0) * 3]);
+                pixels += n;
+            }
+        }
+        numa_record(start, pixels);
+    }
+}
+
+/*
+ * Largest power-of-two tile side whose working set stays cache resident:
+ * the three vectors a kernel touches must fit in half of L1 and the whole
+ * evaluation stack in half of L2
+ */
+int choose_tile_size(Program *fused)
+{
+    long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    int tile = TILED_MAX_SIZE;
+
+    if (l1 <= 0)
+        l1 = 32 * 1024;
+    if (l2 <= 0)
+        l2 = 256 * 1024;
+    while (tile > TILED_MIN_SIZE) {
+        long lanes = (long)tile * tile;
+        if (3 * lanes * sizeof(double) <= l1 / 2
+                && fused->stack_size * lanes * sizeof(double) <= l2 / 2)
+            break;
+        tile /= 2;
+    }
+    return tile;
+}
+
+/* Gather the even bits of a Morton code */
+static unsigned morton_compact(unsigned code)
+{
+    code &= 0x55555555;
+    code = (code | (code >> 1)) & 0x33333333;
+    code = (code | (code >> 2)) & 0x0f0f0f0f;
+    code = (code | (code >> 4)) & 0x00ff00ff;
+    code = (code | (code >> 8)) & 0x0000ffff;
+    return code;
+}
+
+/* A tiled render and the scratch of each worker */
+typedef struct TiledJob {
+    unsigned char *img;
+    int width, height;
+    Program *fused;
+    int tile, cols;
+    int *order;
+    double **stacks, **xs, **ys;
+    unsigned char **rgbs;
+} TiledJob;
+
+static void render_tiled_tile(TiledJob *job, int worker, int t)
+{
+    int tile = job->tile, width = job->width, height = job->height;
+    int i0 = job->order[t] / job->cols * tile, j0 = job->order[t] % job->cols * tile;
+    int h = height - i0 < tile ? height - i0 : tile;
+    int w = width - j0 < tile ? width - j0 : tile;
+    double *xs = job->xs[worker], *ys = job->ys[worker];
+    unsigned char *rgb = job->rgbs[worker];
+
+    for (int i = 0; i < h; i++) {
+        for (int j = 0; j < w; j++) {
+            xs[i * w + j] = (double)(i0 + i) / (double)height * 2 - 1;
+            ys[i * w + j] = (double)(j0 + j) / (double)width * 2 - 1;
+        }
+    }
+    evaluate_fused_tile(job->fused, job->stacks[worker], tile * tile, xs, ys, h * w, rgb);
+    for (int i = 0; i < h; i++)
+        memcpy(&job->img[((i0 + i) * width + j0) * 3], &rgb[i * w * 3], w * 3);
+}
+
+static void run_tiled_task(StealPool *pool, int worker, long task, void *data)
+{
+    render_tiled_tile(data, worker, task);
+}
+
+/*
+ * Square tiles are walked in Morton order and each one is evaluated
+ * instruction by instruction over all of its pixels, so the intermediate
+ * vectors live in a per-thread scratch stack sized by choose_tile_size.
+ * With a pool, each worker starts with a contiguous run of the order and
+ * steals when it runs dry.
+ */
+void fill_image_tiled(unsigned char *img, int width, int height,
+        Program *fused, int tile, int threads_cnt, StealPool *pool)
+{
+    int rows = (height + tile - 1) / tile, cols = (width + tile - 1) / tile;
+    unsigned side = 1;
+    while (side < (unsigned)rows || side < (unsigned)cols)
+        side *= 2;
+
+    int *order = malloc(sizeof(int) * rows * cols);
+    int tiles_cnt = 0;
+    for (unsigned code = 0; code < side * side; code++) {
+        unsigned ti = morton_compact(code >> 1), tj = morton_compact(code);
+        if (ti < (unsigned)rows && tj < (unsigned)cols)
+            order[tiles_cnt++] = ti * cols + tj;
+    }
+
+    TiledJob job = { img, width, height, fused, tile, cols, order };
+    job.stacks = malloc(sizeof(double*) * threads_cnt);
+    job.xs = malloc(sizeof(double*) * threads_cnt);
+    job.ys = malloc(sizeof(double*) * threads_cnt);
+    job.rgbs = malloc(sizeof(unsigned char*) * threads_cnt);
+
+    if (pool)
+        init_steal_pool(pool, threads_cnt, run_tiled_task, &job);
+
+#   pragma omp parallel num_threads(threads_cnt)
+    {
+        int worker = omp_get_thread_num(), lanes = tile * tile;
+        job.stacks[worker] = malloc(sizeof(double) * fused->stack_size * lanes);
+        job.xs[worker] = malloc(sizeof(double) * lanes);
+        job.ys[worker] = malloc(sizeof(double) * lanes);
+        job.rgbs[worker] = malloc(lanes * 3);
+
+        if (pool) {
+            /*
+             * Each worker seeds its own deque once its scratch exists, as a
+             * full deque runs the pushed tile right away. Pushed in reverse
+             * so that the worker takes its run in order.
+             */
+            long begin = (long)tiles_cnt * worker / threads_cnt;
+            long end = (long)tiles_cnt * (worker + 1) / threads_cnt;
+            for (long t = end - 1; t >= begin; t--)
+                steal_push(pool, worker, t);
+#           pragma omp barrier
+            steal_run(pool);
+        }
+        else {
+#           pragma omp for schedule(dynamic, 1)
+            for (int t = 0; t < tiles_cnt; t++)
+                render_tiled_tile(&job, worker, t);
+        }
+
+        free(job.stacks[worker]);
+        free(job.xs[worker]);
+        free(job.ys[worker]);
+        free(job.rgbs[worker]);
+    }
+
+    free(job.stacks);
+    free(job.xs);
+    free(job.ys);
+    free(job.rgbs);
+    free(order);
+}
+
+/*
+ * starts[pc] is the first instruction of the subtree whose root is
+ * prog->code[pc]; in postfix order the subtree is the range starts[pc]..pc.
+ * depths[pc] is the stack depth that range needs on its own.
+ */
+static void find_subtree_starts(Program *prog, int *starts, int *depths)
+{
+    int *stack = malloc(sizeof(int) * prog->stack_size);
+    int sp = 0;
+
+    for (int pc = 0; pc < prog->len; pc++) {
+        int arity = func_collection[prog->code[pc].op].arity;
+        sp -= arity;
+        depths[pc] = 1;
+        for (int i = 0; i < arity; i++) {
+            if (i + depths[stack[sp + i]] > depths[pc])
+                depths[pc] = i + depths[stack[sp + i]];
+        }
+        starts[pc] = arity == 0 ? pc : starts[stack[sp]];
+        stack[sp++] = pc;
+    }
+
+    free(stack);
+}
+
+/*
+ * Evaluate the subtree ending at prog->code[end] over n lanes. Inline
+ * subtrees have no scheduling point, so they use the scratch stack of the
+ * thread that runs them.
+ */
+static void evaluate_task_subtree(Program *prog, int *starts, int *depths, int end,
+        double *xs, double *ys, int n, double *out, double **scratch, long *tasks_cnt)
+{
+    Instruction *ins = &prog->code[end];
+    int arity = func_collection[ins->op].arity;
+    int arg_end = end - 1;
+
+    /* Small subtrees run inline as one batch of lanes, like the simd engine */
+    if (arity == 0 || (long)(end - starts[end] + 1) * n < TASK_GRAIN) {
+        double *stack = scratch[omp_get_thread_num()];
+        int sp = 0;
+        for (int pc = starts[end]; pc <= end; pc++)
+            sp = execute_tile_instruction(&prog->code[pc], stack, n, sp, xs, ys, n);
+        memcpy(out, stack, sizeof(double) * n);
+        return;
+    }
+
+    /* Arguments are laid out as stack slots so the instruction applies as is */
+    double *args = malloc(sizeof(double) * arity * n);
+    for (int i = arity - 1; i >= 0; i--) {
+        long cost = (long)(arg_end - starts[arg_end] + 1) * n;
+        if (cost >= TASK_GRAIN) {
+#           pragma omp atomic
+            (*tasks_cnt)++;
+        }
+#       pragma omp task if(cost >= TASK_GRAIN)
+        evaluate_task_subtree(prog, starts, depths, arg_end, xs, ys, n, &args[i * n],
+                scratch, tasks_cnt);
+        arg_end = starts[arg_end] - 1;
+    }
+#   pragma omp taskwait
+
+    execute_tile_instruction(ins, args, n, arity, xs, ys, n);
+    memcpy(out, args, sizeof(double) * n);
+    free(args);
+}
+
+/*
+ * Every tile is a task, and inside it every subtree whose size times the
+ * tile area reaches TASK_GRAIN is a task evaluating over the whole tile into
+ * its own buffer, so scheduling is amortized over thousands of pixels.
+ * Returns the number of subtree tasks.
+ */
+long fill_image_tasks(unsigned char *img, int width, int height,
+        Program progs[3], int threads_cnt)
+{
+    int rows = (height + TASK_TILE - 1) / TASK_TILE, cols = (width + TASK_TILE - 1) / TASK_TILE;
+    int *starts[3], *depths[3];
+    int scratch_depth = 1;
+    long tasks_cnt = 0;
+
+    for (int c = 0; c < 3; c++) {
+        starts[c] = malloc(sizeof(int) * progs[c].len);
+        depths[c] = malloc(sizeof(int) * progs[c].len);
+        find_subtree_starts(&progs[c], starts[c], depths[c]);
+        /* Deepest subtree that can run inline, on a tile of a single pixel */
+        for (int pc = 0; pc < progs[c].len; pc++) {
+            if (pc - starts[c][pc] + 1 < TASK_GRAIN && depths[c][pc] > scratch_depth)
+                scratch_depth = depths[c][pc];
+        }
+    }
+    double **scratch = malloc(sizeof(double*) * threads_cnt);
+
+#   pragma omp parallel num_threads(threads_cnt)
+    {
+        scratch[omp_get_thread_num()] = malloc(sizeof(double) * scratch_depth * TASK_TILE * TASK_TILE);
+#       pragma omp barrier
+#       pragma omp single
+        for (int t = 0; t < rows * cols; t++) {
+#           pragma omp task shared(tasks_cnt)
+            {
+                int i0 = t / cols * TASK_TILE, j0 = t % cols * TASK_TILE;
+                int h = height - i0 < TASK_TILE ? height - i0 : TASK_TILE;
+                int w = width - j0 < TASK_TILE ? width - j0 : TASK_TILE;
+                int n = h * w;
+                double *xs = malloc(sizeof(double) * n);
+                double *ys = malloc(sizeof(double) * n);
+                double *vals = malloc(sizeof(double) * 3 * n);
+
+                for (int i = 0; i < h; i++) {
+                    for (int j = 0; j < w; j++) {
+                        xs[i * w + j] = (double)(i0 + i) / (double)height * 2 - 1;
+                        ys[i * w + j] = (double)(j0 + j) / (double)width * 2 - 1;
+                    }
+                }
+                for (int c = 0; c < 3; c++) {
+#                   pragma omp task
+                    evaluate_task_subtree(&progs[c], starts[c], depths[c], progs[c].len - 1,
+                            xs, ys, n, &vals[c * n], scratch, &tasks_cnt);
+                }
+#               pragma omp taskwait
+
+                for (int i = 0; i < h; i++) {
+                    for (int j = 0; j < w; j++) {
+                        for (int c = 0; c < 3; c++)
+                            img[((i0 + i) * width + j0 + j) * 3 + c] = (vals[c * n + i * w + j] + 1) / 2 * 255;
+                    }
+                }
+                free(xs);
+                free(ys);
+                free(vals);
+            }
+        }
+
+        free(scratch[omp_get_thread_num()]);
+    }
+
+    for (int c = 0; c < 3; c++) {
+        free(starts[c]);
+        free(depths[c]);
+    }
+    free(scratch);
+
+    return tasks_cnt;
+}
+
+void fill_image_jit(unsigned char *img, int width, int height,
+        JitCode *jit, int threads_cnt)
+{
+#   pragma omp parallel num_threads(threads_cnt)
+    {
+        double start = omp_get_wtime();
+        long pixels = 0;
+
+#       pragma omp for collapse(2) schedule(runtime) nowait
+        for (int i = 0; i < height; i++) {
+            for (int j = 0; j < width; j++) {
+                int idx = (i * width + j) * 3;
+                double x_norm = (double)i / (double)height * 2 - 1;
+                double y_norm = (double)j / (double)width * 2 - 1;
+                double out[3];
+                jit->func(x_norm, y_norm, out);
+                img[idx + 0] = (out[0] + 1) / 2 * 255;
+                img[idx + 1] = (out[1] + 1) / 2 * 255;
+                img[idx + 2] = (out[2] + 1) / 2 * 255;
+                pixels++;
+            }
+        }
+        numa_record(start, pixels);
+    }
+}
+
+void fill_image_aot(unsigned char *img, int width, int height,
+        AotCode *aot, int threads_cnt)
+{
+#   pragma omp parallel for num_threads(threads_cnt)
+    for (int i = 0; i < height; i++) {
+        aot->fill(img, width, height, i, i + 1);
+    }
+}
+
+void fill_image_dag(unsigned char *img, int width, int height,
+        Dag *dag, int threads_cnt)
+{
+#   pragma omp parallel num_threads(threads_cnt)
+    {
+        double *vals = (double*)malloc(sizeof(double) * dag->len);
+        double start = omp_get_wtime();
+        long pixels = 0;
+
+#       pragma omp for collapse(2) schedule(runtime) nowait
+        for (int i = 0; i < height; i++) {
+            for (int j = 0; j < width; j++) {
+                int idx = (i * width + j) * 3;
+                double x_norm = (double)i / (double)height * 2 - 1;
+                double y_norm = (double)j / (double)width * 2 - 1;
+                double out[3];
+                evaluate_dag(dag, x_norm, y_norm, vals, out);
+                img[idx + 0] = (out[0] + 1) / 2 * 255;
+                img[idx + 1] = (out[1] + 1) / 2 * 255;
+                img[idx + 2] = (out[2] + 1) / 2 * 255;
+                pixels++;
+            }
+        }
+        numa_record(start, pixels);
+
+        free(vals);
+    }
+}
+
+void fill_image_hoist(unsigned char *img, int width, int height,
+        Dag *dag, HoistPlan *plan, int threads_cnt)
+{
+    double *x_table = (double*)malloc(sizeof(double) * height * plan->x_frontier_len);
+    double *y_table = (double*)malloc(sizeof(double) * width * plan->y_frontier_len);
+    int *mixed = plan->nodes[DEP_MIXED];
+    int mixed_len = plan->nodes_len[DEP_MIXED];
+
+#   pragma omp parallel num_threads(threads_cnt)
+    {
+        double *vals = (double*)malloc(sizeof(double) * dag->len);
+
+        for (int k = 0; k < plan->nodes_len[DEP_CONST]; k++)
+            evaluate_dag_node(dag, plan->nodes[DEP_CONST][k], 0, 0, vals);
+
+#       pragma omp for
+        for (int i = 0; i < height; i++) {
+            double x_norm = (double)i / (double)height * 2 - 1;
+            for (int k = 0; k < plan->nodes_len[DEP_X]; k++)
+                evaluate_dag_node(dag, plan->nodes[DEP_X][k], x_norm, 0, vals);
+            for (int k = 0; k < plan->x_frontier_len; k++)
+                x_table[i * plan->x_frontier_len + k] = vals[plan->x_frontier[k]];
+        }
+
+#       pragma omp for
+        for (int j = 0; j < width; j++) {
+            double y_norm = (double)j / (double)width * 2 - 1;
+            for (int k = 0; k < plan->nodes_len[DEP_Y]; k++)
+                evaluate_dag_node(dag, plan->nodes[DEP_Y][k], 0, y_norm, vals);
+            for (int k = 0; k < plan->y_frontier_len; k++)
+                y_table[j * plan->y_frontier_len + k] = vals[plan->y_frontier[k]];
+        }
+
+#       pragma omp for
+        for (int i = 0; i < height; i++) {
+            double x_norm = (double)i / (double)height * 2 - 1;
+            for (int k = 0; k < plan->x_frontier_len; k++)
+                vals[plan->x_frontier[k]] = x_table[i * plan->x_frontier_len + k];
+
+            for (int j = 0; j < width; j++) {
+                int idx = (i * width + j) * 3;
+                double y_norm = (double)j / (double)width * 2 - 1;
+                for (int k = 0; k < plan->y_frontier_len; k++)
+                    vals[plan->y_frontier[k]] = y_table[j * plan->y_frontier_len + k];
+                for (int k = 0; k < mixed_len; k++)
+                    evaluate_dag_node(dag, mixed[k], x_norm, y_norm, vals);
+                img[idx + 0] = (vals[dag->roots[0]] + 1) / 2 * 255;
+                img[idx + 1] = (vals[dag->roots[1]] + 1) / 2 * 255;
+                img[idx + 2] = (vals[dag->roots[2]] + 1) / 2 * 255;
+            }
+        }
+
+        free(vals);
+    }
+
+    free(x_table);
+    free(y_table);
+}
+
+/* Evaluate node n for the strip pixels k0..k1 - 1; bufs holds one slot per stride */
+static void wavefront_node(Dag *dag, WavefrontPlan *plan, int n, double *bufs, int stride,
+        double *xs, double *ys, int k0, int k1)
+{
+    DagNode *node = &dag->nodes[n];
+    int *args = &dag->args[node->first_arg];
+    double *d = &bufs[(long)plan->slot[n] * stride];
+    double *a = node->arity > 0 ? &bufs[(long)plan->slot[args[0]] * stride] : NULL;
+    double *b = node->arity > 1 ? &bufs[(long)plan->slot[args[1]] * stride] : NULL;
+
+    switch (node->op) {
+    case OP_GET_X:
+        memcpy(&d[k0], &xs[k0], sizeof(double) * (k1 - k0));
+        break;
+    case OP_GET_Y:
+        memcpy(&d[k0], &ys[k0], sizeof(double) * (k1 - k0));
+        break;
+    case OP_RAND:
+        for (int k = k0; k < k1; k++)
+            d[k] = node->imm;
+        break;
+    case OP_ID:
+        memcpy(&d[k0], &a[k0], sizeof(double) * (k1 - k0));
+        break;
+    case OP_NEG:
+        for (int k = k0; k < k1; k++)
+            d[k] = -a[k];
+        break;
+    case OP_ADD:
+        for (int k = k0; k < k1; k++)
+            d[k] = (a[k] + b[k]) / 2;
+        break;
+    case OP_MULT:
+        for (int k = k0; k < k1; k++)
+            d[k] = a[k] * b[k];
+        break;
+    case OP_MIX: {
+        double *c = &bufs[(long)plan->slot[args[2]] * stride];
+        for (int k = k0; k < k1; k++) {
+            double prop = (c[k] + 1) / 2;
+            d[k] = a[k] * prop + b[k] * (1 - prop);
+        }
+        break;
+    }
+    default: {
+        double params[MAX_ARG_NUM];
+        for (int k = k0; k < k1; k++) {
+            for (int i = 0; i < node->arity; i++)
+                params[i] = bufs[(long)plan->slot[args[i]] * stride + k];
+            d[k] = kernel_func(node->op)(params);
+        }
+        break;
+    }
+    }
+}
+
+/*
+ * Bottom-up over the levels of the plan, one strip of WAVEFRONT_STRIP
+ * pixels at a time: a level is a single flat loop over its nodes and
+ * blocks of pixels, followed by the only barrier of the level.
+ */
+void fill_image_wavefront(unsigned char *img, int width, int height,
+        Dag *dag, WavefrontPlan *plan, int threads_cnt)
+{
+    long pixels = (long)width * height;
+    int stride = pixels < WAVEFRONT_STRIP ? pixels : WAVEFRONT_STRIP;
+    int blocks = (stride + WAVEFRONT_BLOCK - 1) / WAVEFRONT_BLOCK;
+    double *bufs = (double*)malloc(sizeof(double) * plan->slots_cnt * stride);
+    double *xs = (double*)malloc(sizeof(double) * stride);
+    double *ys = (double*)malloc(sizeof(double) * stride);
+
+#   pragma omp parallel num_threads(threads_cnt)
+    for (long p0 = 0; p0 < pixels; p0 += stride) {
+        int n = pixels - p0 < stride ? pixels - p0 : stride;
+
+#       pragma omp for
+        for (int k = 0; k < n; k++) {
+            xs[k] = (double)((p0 + k) / width) / (double)height * 2 - 1;
+            ys[k] = (double)((p0 + k) % width) / (double)width * 2 - 1;
+        }
+
+        for (int l = 0; l < plan->levels; l++) {
+#           pragma omp for collapse(2) schedule(static)
+            for (int q = plan->level_start[l]; q < plan->level_start[l + 1]; q++) {
+                for (int b = 0; b < blocks; b++) {
+                    int k0 = b * WAVEFRONT_BLOCK;
+                    int k1 = k0 + WAVEFRONT_BLOCK < n ? k0 + WAVEFRONT_BLOCK : n;
+                    if (k0 < k1)
+                        wavefront_node(dag, plan, plan->order[q], bufs, stride, xs, ys, k0, k1);
+                }
+            }
+        }
+
+#       pragma omp for
+        for (int k = 0; k < n; k++) {
+            for (int c = 0; c < 3; c++)
+                img[(p0 + k) * 3 + c] = (bufs[(long)plan->slot[dag->roots[c]] * stride + k] + 1) / 2 * 255;
+        }
+    }
+
+    free(bufs);
+    free(xs);
+    free(ys);
+}
+
+/* A culling render and the scratch and skipped count of each worker */
+typedef struct CullJob {
+    unsigned char *img;
+    int width, height;
+    Dag *dag;
+    Interval **ivals;
+    double **vals;
+    long *skipped;
+} CullJob;
+
+/* A tile as a task, 16 bits per bound */
+static long cull_task(int i0, int i1, int j0, int j1)
+{
+    return (long)i0 << 48 | (long)i1 << 32 | (long)j0 << 16 | j1;
+}
+
+/*
+ * Fill the tile of rows [i0, i1) and columns [j0, j1) and return how many
+ * of its pixels did not need to be evaluated. If the bounds of every
+ * channel over the tile quantize to one byte value, the tile is filled
+ * with it; otherwise it is split into four, down to CULL_MIN_SIZE.
+ * With a pool, the quadrants of a split tile become tasks of the worker.
+ */
+static long cull_tile(unsigned char *img, int width, int height, Dag *dag,
+        Interval *ivals, double *vals, int i0, int i1, int j0, int j1,
+        StealPool *pool, int worker)
+{
+    Interval x = { (double)i0 / (double)height * 2 - 1, (double)(i1 - 1) / (double)height * 2 - 1 };
+    Interval y = { (double)j0 / (double)width * 2 - 1, (double)(j1 - 1) / (double)width * 2 - 1 };
+    Interval bounds[3];
+    unsigned char color[3];
+    int constant = 1;
+
+    evaluate_dag_interval(dag, x, y, ivals, bounds);
+    for (int c = 0; c < 3 && constant; c++) {
+        /* Outside [-1, 1] the conversion to unsigned char is not monotonic */
+        if (bounds[c].lo < -1 || bounds[c].hi > 1) {
+            constant = 0;
+            break;
+        }
+        color[c] = (bounds[c].lo + 1) / 2 * 255;
+        constant = color[c] == (unsigned char)((bounds[c].hi + 1) / 2 * 255);
+    }
+
+    if (constant) {
+        for (int i = i0; i < i1; i++) {
+            for (int j = j0; j < j1; j++)
+                memcpy(&img[(i * width + j) * 3], color, 3);
+        }
+        return (long)(i1 - i0) * (j1 - j0);
+    }
+
+    if ((i1 - i0 > CULL_MIN_SIZE || j1 - j0 > CULL_MIN_SIZE) && pool) {
+        int im = (i0 + i1 + 1) / 2, jm = (j0 + j1 + 1) / 2;
+        steal_push(pool, worker, cull_task(i0, im, j0, jm));
+        if (jm < j1)
+            steal_push(pool, worker, cull_task(i0, im, jm, j1));
+        if (im < i1) {
+            steal_push(pool, worker, cull_task(im, i1, j0, jm));
+            if (jm < j1)
+                steal_push(pool, worker, cull_task(im, i1, jm, j1));
+        }
+        return 0;
+    }
+    if (i1 - i0 > CULL_MIN_SIZE || j1 - j0 > CULL_MIN_SIZE) {
+        int im = (i0 + i1 + 1) / 2, jm = (j0 + j1 + 1) / 2;
+        long skipped = cull_tile(img, width, height, dag, ivals, vals, i0, im, j0, jm, NULL, 0);
+        if (jm < j1)
+            skipped += cull_tile(img, width, height, dag, ivals, vals, i0, im, jm, j1, NULL, 0);
+        if (im < i1) {
+            skipped += cull_tile(img, width, height, dag, ivals, vals, im, i1, j0, jm, NULL, 0);
+            if (jm < j1)
+                skipped += cull_tile(img, width, height, dag, ivals, vals, im, i1, jm, j1, NULL, 0);
+        }
+        return skipped;
+    }
+
+    for (int i = i0; i < i1; i++) {
+        for (int j = j0; j < j1; j++) {
+            int idx = (i * width + j) * 3;
+            double x_norm = (double)i / (double)height * 2 - 1;
+            double y_norm = (double)j / (double)width * 2 - 1;
+            double out[3];
+            evaluate_dag(dag, x_norm, y_norm, vals, out);
+            img[idx + 0] = (out[0] + 1) / 2 * 255;
+            img[idx + 1] = (out[1] + 1) / 2 * 255;
+            img[idx + 2] = (out[2] + 1) / 2 * 255;
+        }
+    }
+    return 0;
+}
+
+static void run_cull_task(StealPool *pool, int worker, long task, void *data)
+{
+    CullJob *job = data;
+    int i0 = task >> 48 & STEAL_MAX_SIDE, i1 = task >> 32 & STEAL_MAX_SIDE;
+    int j0 = task >> 16 & STEAL_MAX_SIDE, j1 = task & STEAL_MAX_SIDE;
+
+    job->skipped[worker] += cull_tile(job->img, job->width, job->height, job->dag,
+            job->ivals[worker], job->vals[worker], i0, i1, j0, j1, pool, worker);
+}
+
+/*
+ * Returns the number of pixels filled without being evaluated. With a pool,
+ * the tiles are dealt round-robin to the workers and split tiles are
+ * stolen quadrant by quadrant.
+ */
+long fill_image_cull(unsigned char *img, int width, int height,
+        Dag *dag, int threads_cnt, StealPool *pool)
+{
+    int tile_rows = (height + CULL_TILE_SIZE - 1) / CULL_TILE_SIZE;
+    int tile_cols = (width + CULL_TILE_SIZE - 1) / CULL_TILE_SIZE;
+    long skipped = 0;
+    CullJob job = { img, width, height, dag };
+
+    job.ivals = malloc(sizeof(Interval*) * threads_cnt);
+    job.vals = malloc(sizeof(double*) * threads_cnt);
+    job.skipped = calloc(threads_cnt, sizeof(long));
+    if (pool)
+        init_steal_pool(pool, threads_cnt, run_cull_task, &job);
+
+#   pragma omp parallel num_threads(threads_cnt)
+    {
+        int worker = omp_get_thread_num();
+        Interval *ivals = (Interval*)malloc(sizeof(Interval) * dag->len);
+        double *vals = (double*)malloc(sizeof(double) * dag->len);
+        job.ivals[worker] = ivals;
+        job.vals[worker] = vals;
+
+        if (pool) {
+            /* Seeded by the owner after allocation, as in fill_image_tiled */
+            for (int t = tile_rows * tile_cols - 1; t >= 0; t--) {
+                if (t % threads_cnt != worker)
+                    continue;
+                int i0 = t / tile_cols * CULL_TILE_SIZE, j0 = t % tile_cols * CULL_TILE_SIZE;
+                int i1 = i0 + CULL_TILE_SIZE < height ? i0 + CULL_TILE_SIZE : height;
+                int j1 = j0 + CULL_TILE_SIZE < width ? j0 + CULL_TILE_SIZE : width;
+                steal_push(pool, worker, cull_task(i0, i1, j0, j1));
+            }
+#           pragma omp barrier
+            steal_run(pool);
+        }
+        else {
+#           pragma omp for collapse(2) schedule(dynamic)
+            for (int ti = 0; ti < tile_rows; ti++) {
+                for (int tj = 0; tj < tile_cols; tj++) {
+                    int i0 = ti * CULL_TILE_SIZE, j0 = tj * CULL_TILE_SIZE;
+                    int i1 = i0 + CULL_TILE_SIZE < height ? i0 + CULL_TILE_SIZE : height;
+                    int j1 = j0 + CULL_TILE_SIZE < width ? j0 + CULL_TILE_SIZE : width;
+                    job.skipped[worker] += cull_tile(img, width, height, dag, ivals, vals,
+                            i0, i1, j0, j1, NULL, 0);
+                }
+            }
+        }
+
+        free(ivals);
+        free(vals);
+    }
+
+    for (int w = 0; w < threads_cnt; w++)
+        skipped += job.skipped[w];
+    free(job.ivals);
+    free(job.vals);
+    free(job.skipped);
+
+    return skipped;
+}
+
+/* Pixel states of the adaptive renderer */
+enum {
+    PIXEL_EMPTY,
+    PIXEL_SAMPLED,
+    PIXEL_INTERPOLATED,
+};
+
+static void adaptive_sample(unsigned char *img, unsigned char *state, int width, int height,
+        Dag *dag, double *vals, int i, int j)
+{
+    int idx = i * width + j;
+    double x_norm = (double)i / (double)height * 2 - 1;
+    double y_norm = (double)j / (double)width * 2 - 1;
+    double out[3];
+
+    if (state[idx] == PIXEL_SAMPLED)
+        return;
+    evaluate_dag(dag, x_norm, y_norm, vals, out);
+    for (int c = 0; c < 3; c++)
+        img[idx * 3 + c] = (out[c] + 1) / 2 * 255;
+    state[idx] = PIXEL_SAMPLED;
+}
+
+/*
+ * Refine the cell with the inclusive corners (i0, j0) and (i1, j1). The
+ * corners and the center are sampled; if the corners differ by at most
+ * threshold in every channel and the center is predicted within threshold
+ * by bilinear interpolation, the rest of the cell is interpolated.
+ * Otherwise the cell is split into four cells sharing its midlines.
+ */
+static void adaptive_refine(unsigned char *img, unsigned char *state, int width, int height,
+        Dag *dag, double *vals, int threshold, int i0, int j0, int i1, int j1)
+{
+    int im = (i0 + i1) / 2, jm = (j0 + j1) / 2;
+    int corners[4] = { i0 * width + j0, i0 * width + j1, i1 * width + j0, i1 * width + j1 };
+    int smooth = 1;
+
+    adaptive_sample(img, state, width, height, dag, vals, i0, j0);
+    adaptive_sample(img, state, width, height, dag, vals, i0, j1);
+    adaptive_sample(img, state, width, height, dag, vals, i1, j0);
+    adaptive_sample(img, state, width, height, dag, vals, i1, j1);
+    if (i1 - i0 <= 1 && j1 - j0 <= 1)
+        return;
+    adaptive_sample(img, state, width, height, dag, vals, im, jm);
+
+    for (int c = 0; c < 3 && smooth; c++) {
+        int lo = 255, hi = 0;
+        double center = 0;
+        for (int k = 0; k < 4; k++) {
+            int v = img[corners[k] * 3 + c];
+            lo = v < lo ? v : lo;
+            hi = v > hi ? v : hi;
+        }
+        center = (double)(img[corners[0] * 3 + c] * (i1 - im) * (j1 - jm)
+                + img[corners[1] * 3 + c] * (i1 - im) * (jm - j0)
+                + img[corners[2] * 3 + c] * (im - i0) * (j1 - jm)
+                + img[corners[3] * 3 + c] * (im - i0) * (jm - j0)) / ((i1 - i0) * (j1 - j0));
+        smooth = hi - lo <= threshold && fabs(center - img[(im * width + jm) * 3 + c]) <= threshold;
+    }
+
+    if (!smooth) {
+        adaptive_refine(img, state, width, height, dag, vals, threshold, i0, j0, im, jm);
+        adaptive_refine(img, state, width, height, dag, vals, threshold, i0, jm, im, j1);
+        adaptive_refine(img, state, width, height, dag, vals, threshold, im, j0, i1, jm);
+        adaptive_refine(img, state, width, height, dag, vals, threshold, im, jm, i1, j1);
+        return;
+    }
+
+    for (int i = i0; i <= i1; i++) {
+        for (int j = j0; j <= j1; j++) {
+            double wi = (double)(i - i0) / (i1 - i0), wj = (double)(j - j0) / (j1 - j0);
+            if (state[i * width + j] == PIXEL_SAMPLED)
+                continue;
+            for (int c = 0; c < 3; c++) {
+                double v = img[corners[0] * 3 + c] * (1 - wi) * (1 - wj)
+                    + img[corners[1] * 3 + c] * (1 - wi) * wj
+                    + img[corners[2] * 3 + c] * wi * (1 - wj)
+                    + img[corners[3] * 3 + c] * wi * wj;
+                img[(i * width + j) * 3 + c] = v + 0.5;
+            }
+            state[i * width + j] = PIXEL_INTERPOLATED;
+        }
+    }
+}
+
+/*
+ * Preview renderer: refine a grid of ADAPTIVE_CELL cells and interpolate
+ * the smooth ones. Neighboring cells share their edges, so the grid is
+ * processed in four passes of a 2x2 coloring in which no two cells of the
+ * same pass touch. Returns the number of evaluated pixels.
+ */
+long fill_image_adaptive(unsigned char *img, int width, int height,
+        Dag *dag, int threshold, int threads_cnt)
+{
+    unsigned char *state = (unsigned char*)calloc((long)width * height, 1);
+    int cell_rows = height > 1 ? (height - 2) / ADAPTIVE_CELL + 1 : 1;
+    int cell_cols = width > 1 ? (width - 2) / ADAPTIVE_CELL + 1 : 1;
+    long sampled = 0;
+
+#   pragma omp parallel num_threads(threads_cnt)
+    {
+        double *vals = (double*)malloc(sizeof(double) * dag->len);
+
+        for (int pass = 0; pass < 4; pass++) {
+#           pragma omp for collapse(2) schedule(dynamic)
+            for (int ci = pass / 2; ci < cell_rows; ci += 2) {
+                for (int cj = pass % 2; cj < cell_cols; cj += 2) {
+                    int i0 = ci * ADAPTIVE_CELL, j0 = cj * ADAPTIVE_CELL;
+                    int i1 = i0 + ADAPTIVE_CELL < height - 1 ? i0 + ADAPTIVE_CELL : height - 1;
+                    int j1 = j0 + ADAPTIVE_CELL < width - 1 ? j0 + ADAPTIVE_CELL : width - 1;
+                    adaptive_refine(img, state, width, height, dag, vals, threshold, i0, j0, i1, j1);
+                }
+            }
+        }
+
+#       pragma omp for reduction(+:sampled)
+        for (long k = 0; k < (long)width * height; k++)
+            sampled += state[k] == PIXEL_SAMPLED;
+
+        free(vals);
+    }
+
+    free(state);
+    return sampled;
+}
+
+/*
+ * Interlaced renderer in the spirit of Adam7: the first pass evaluates
+ * every PROGRESSIVE_STEP-th pixel in both directions, and every further
+ * pass halves the step and evaluates only the pixels that are new on the
+ * finer grid. After each pass the pixels not evaluated yet are filled
+ * from the sample at the top-left of their block, and callback receives
+ * the resulting preview.
+ */
+void fill_image_progressive(unsigned char *img, int width, int height,
+        Dag *dag, int threads_cnt, PassCallback callback, void *data)
+{
+    int pass = 0;
+
+    for (int step = PROGRESSIVE_STEP; step >= 1; step /= 2, pass++) {
+#       pragma omp parallel num_threads(threads_cnt)
+        {
+            double *vals = (double*)malloc(sizeof(double) * dag->len);
+
+#           pragma omp for schedule(dynamic)
+            for (int i = 0; i < height; i += step) {
+                for (int j = 0; j < width; j += step) {
+                    int idx = (i * width + j) * 3;
+                    double x_norm = (double)i / (double)height * 2 - 1;
+                    double y_norm = (double)j / (double)width * 2 - 1;
+                    double out[3];
+                    /* Samples of the coarser passes are already there */
+                    if (step < PROGRESSIVE_STEP && i % (2 * step) == 0 && j % (2 * step) == 0)
+                        continue;
+                    evaluate_dag(dag, x_norm, y_norm, vals, out);
+                    img[idx + 0] = (out[0] + 1) / 2 * 255;
+                    img[idx + 1] = (out[1] + 1) / 2 * 255;
+                    img[idx + 2] = (out[2] + 1) / 2 * 255;
+                }
+            }
+
+            if (step > 1) {
+#               pragma omp for
+                for (int i = 0; i < height; i++) {
+                    for (int j = 0; j < width; j++) {
+                        int i_s = i - i % step, j_s = j - j % step;
+                        if (i == i_s && j == j_s)
+                            continue;
+                        memcpy(&img[(i * width + j) * 3], &img[(i_s * width + j_s) * 3], 3);
+                    }
+                }
+            }
+
+            free(vals);
         }
+
+        if (callback)
+            callback(img, width, height, pass, step, data);
     }
-    return -1;
 }
 
-int find_func(char *func_name)
+/* Reports the time to each pass and optionally saves the previews */
+void report_pass(unsigned char *img, int width, int height, int pass, int step, void *data)
 {
-    int i = 0; 
-    for (; i < sizeof(func_collection) / sizeof(FuncInfo); i++) {
-        if (strcmp(func_name, func_collection[i].func_name) == 0)
-            return i;
+    PassReport *report = (PassReport*)data;
+    printf("Pass %d (every %d pixel(s)) ready after %.4f\n", pass, step,
+            omp_get_wtime() - report->tstart);
+    if (report->prefix) {
+        char file_name[1024];
+        snprintf(file_name, sizeof(file_name), "%s-pass%d.png", report->prefix, pass);
+        if (!stbi_write_png(file_name, width, height, 3, img, 3 * width))
+            fprintf(stderr, "Failed to save %s\n", file_name);
     }
-    return -1;
 }
 
-int parse_from_file(char *file_name, int entry_symbol_arr[3], Rule grammar[MAX_RULE_NUM])
+
+/* Time one render of a strip of rows with cfg */
+static double auto_render(AutoConfig *cfg, unsigned char *img, int width, int rows,
+        ExpressionNode *roots[3], Program progs[3], Program *fused, JitCode *jit, Dag *dag)
 {
-    FILE *file = fopen(file_name, "r");
-    char line_buffer[1024];
+    double tstart = omp_get_wtime();
 
-    if (file == NULL) {
-        fprintf(stderr, "Error opening file %s\n", file_name);
-        return EXIT_FAILURE;
+    omp_set_schedule(cfg->sched, cfg->chunk);
+    switch (cfg->engine) {
+    case ENGINE_BYTECODE:
+        fill_image_bytecode(img, width, rows, progs, cfg->threads_cnt);
+        break;
+    case ENGINE_SIMD:
+        fill_image_simd(img, width, rows, progs, cfg->threads_cnt);
+        break;
+    case ENGINE_FUSED:
+        fill_image_fused(img, width, rows, fused, cfg->threads_cnt);
+        break;
+    case ENGINE_TILED:
+        fill_image_tiled(img, width, rows, fused, cfg->tile, cfg->threads_cnt, NULL);
+        break;
+    case ENGINE_JIT:
+        fill_image_jit(img, width, rows, jit, cfg->threads_cnt);
+        break;
+    case ENGINE_DAG:
+        fill_image_dag(img, width, rows, dag, cfg->threads_cnt);
+        break;
+    default:
+        fill_image_loop_parallel(img, width, rows, roots[0], roots[1], roots[2], cfg->threads_cnt);
+        break;
     }
+    return omp_get_wtime() - tstart;
+}
 
-    /* Get defined symbols */
-    char symbol_arr[MAX_RULE_NUM][MAX_SYMBOL_LEN + 1];
-    char *symbol;
-    int symbol_pos;
-    int symbol_arr_size = 0;
-
-    if (!get_real_line(line_buffer, sizeof(line_buffer), file)) {
-        perror("Symbol definitions expected\n");
-        return EXIT_FAILURE;
-    }
-    symbol = strtok(line_buffer, " \t\n");
-    while (symbol) {
-        if (strlen(symbol) > MAX_SYMBOL_LEN) {
-            fprintf(stderr, 
-                    "The name \"%s\" exceeds the maximum length of %d characters\n",
-                    symbol, MAX_SYMBOL_LEN);
-            return EXIT_FAILURE;
-        }
-        strcpy(symbol_arr[symbol_arr_size++], symbol);
-        symbol = strtok(NULL, " \t\n");
+/* Best of two runs, so that the first one can warm the caches and the team */
+static void auto_try(AutoConfig *cfg, AutoConfig *best, double *best_time, unsigned char *img,
+        int width, int rows, ExpressionNode *roots[3], Program progs[3], Program *fused,
+        JitCode *jit, Dag *dag)
+{
+    double t = auto_render(cfg, img, width, rows, roots, progs, fused, jit, dag);
+    double t2 = auto_render(cfg, img, width, rows, roots, progs, fused, jit, dag);
+    t = t2 < t ? t2 : t;
+    if (t < *best_time) {
+        *best_time = t;
+        *best = *cfg;
     }
+}
 
-    /* Get entry symbols */
-    int entry_symbol_arr_size = 0;
+/*
+ * Pick the fastest configuration on a calibration render of AUTO_ROWS rows
+ * spanning the whole image, one dimension at a time: the engine (and tile
+ * size) with all processors, then the loop schedule and chunk, then the
+ * number of threads. jit may be unusable (buf NULL) and is then skipped.
+ */
+void autotune(AutoConfig *best, int width, int height, ExpressionNode *roots[3],
+        Program progs[3], Program *fused, JitCode *jit, Dag *dag)
+{
+    int rows = height < AUTO_ROWS ? height : AUTO_ROWS;
+    int procs = omp_get_num_procs();
+    unsigned char *img = (unsigned char*)malloc((long)width * rows * 3);
+    int engines[] = { ENGINE_TREE, ENGINE_BYTECODE, ENGINE_SIMD, ENGINE_FUSED, ENGINE_JIT, ENGINE_DAG };
+    int scheds[] = { omp_sched_static, omp_sched_dynamic, omp_sched_guided };
+    int chunks[] = { 0, 16, 256 };
+    double best_time = INFINITY;
+    AutoConfig cfg = { ENGINE_TREE, omp_sched_static, 0, 0, procs };
 
-    if (!get_real_line(line_buffer, sizeof(line_buffer), file)) {
-        perror("Entry symbols expected\n");
-        return EXIT_FAILURE;
+    for (int e = 0; e < sizeof(engines) / sizeof(int); e++) {
+        if (engines[e] == ENGINE_JIT && jit->buf == NULL)
+            continue;
+        /* --float only changes bytecode and simd, so the others are not candidates */
+        if (use_float && engines[e] != ENGINE_BYTECODE && engines[e] != ENGINE_SIMD)
+            continue;
+        cfg.engine = engines[e];
+        auto_try(&cfg, best, &best_time, img, width, rows, roots, progs, fused, jit, dag);
     }
-    symbol = strtok(line_buffer, " \t\n");
-    while (symbol) {
-        if (entry_symbol_arr_size > 3) {
-            fprintf(stderr, "Too many entry symbols; 3 entry symbols are expected (RGB)\n");
-            return EXIT_FAILURE;
-        }
-        symbol_pos = find_symbol(symbol, symbol_arr, symbol_arr_size);
-        if (symbol_pos < 0) {
-            fprintf(stderr, "Symbol \"%s\" is not defined\n", symbol);
-            return EXIT_FAILURE;
+    cfg.engine = ENGINE_TILED;
+    for (cfg.tile = TILED_MIN_SIZE * 2; cfg.tile <= rows && !use_float; cfg.tile *= 2)
+        auto_try(&cfg, best, &best_time, img, width, rows, roots, progs, fused, jit, dag);
+
+    /* The tiled engine deals its tiles itself */
+    cfg = *best;
+    for (int k = 0; k < 3 && cfg.engine != ENGINE_TILED; k++) {
+        for (int c = 0; c < 3; c++) {
+            cfg.sched = scheds[k];
+            cfg.chunk = chunks[c];
+            auto_try(&cfg, best, &best_time, img, width, rows, roots, progs, fused, jit, dag);
         }
-        entry_symbol_arr[entry_symbol_arr_size++] = symbol_pos;
-        symbol = strtok(NULL, " \t\n");
     }
-    if (entry_symbol_arr_size < 3) {
-        fprintf(stderr, "3 entry symbols are expected (RGB); only got %d\n", entry_symbol_arr_size);
-        return EXIT_FAILURE;
+
+    cfg = *best;
+    for (int threads = 1; threads < procs; threads *= 2) {
+        cfg.threads_cnt = threads;
+        auto_try(&cfg, best, &best_time, img, width, rows, roots, progs, fused, jit, dag);
     }
 
-    /* Get the rules */
-    while (get_real_line(line_buffer, sizeof(line_buffer), file)) {
-        char *arrow;
-        int master_pos;
-        int func_cnt = 0;
+    free(img);
+}
 
-        symbol = strtok(line_buffer, " \t\n");
-        symbol_pos = find_symbol(symbol, symbol_arr, symbol_arr_size);
-        if (symbol_pos < 0) {
-            fprintf(stderr, "Symbol \"%s\" is not defined\n", symbol);
-            return EXIT_FAILURE;
-        }
-        master_pos = symbol_pos;
-        arrow = strtok(NULL, " \t\n");
-        if (strcmp(arrow, "->") != 0) {
-            fprintf(stderr, "-> is expected to define a rule\n");
-            return EXIT_FAILURE;
-        }
+/*
+ * The cache holds one decision per line, keyed on the host, the tree and
+ * image sizes, and the flags that change which engine wins; lines in any
+ * other format are skipped
+ */
+int load_auto_config(AutoConfig *cfg, int nodes, int width, int height, char *flags)
+{
+    char host[256] = "", line[1024], line_host[256], line_flags[256], engine_name[32];
+    int line_nodes, line_width, line_height, found = 0;
+    AutoConfig line_cfg;
+    FILE *file = fopen(AUTO_CACHE_FILE, "r");
 
-        while (1) {
-            char *prob;
-            char *func_name;
-            int arity = 0;
-            int func_pos;
-            prob = strtok(NULL, " \t\n");
-            if (!atof(prob)) {
-                fprintf(stderr, "Float for probability is expected, got \"%s\"\n", prob);
-                return EXIT_FAILURE;
-            }
-            grammar[master_pos].sub_rules[func_cnt].prob = atof(prob);
-            func_name = strtok(NULL, " \t\n");
-            func_pos = find_func(func_name);
-            if (func_pos < 0) {
-                fprintf(stderr, "Function \"%s\" is not valid\n", func_name);
-                return EXIT_FAILURE;
-            }
-            func_info_cpy(&grammar[master_pos].sub_rules[func_cnt].func_info, &func_collection[func_pos]);
-            while (1) {
-                symbol = strtok(NULL, " \t\n");
-                if (!symbol || strcmp(symbol, "|") == 0)
-                    break;
-                symbol_pos = find_symbol(symbol, symbol_arr, symbol_arr_size);
-                if (symbol_pos < 0) {
-                    fprintf(stderr, "Symbol \"%s\" is not defined\n", symbol);
-                }
-                grammar[master_pos].sub_rules[func_cnt].args[arity++] = symbol_pos;
-            }
-            if (arity != grammar[master_pos].sub_rules[func_cnt].func_info.arity) {
-                fprintf(stderr, "%s expect %d arguments; got %d\n", 
-                        grammar[master_pos].sub_rules[func_cnt].func_info.func_name,
-                        grammar[master_pos].sub_rules[func_cnt].func_info.arity,
-                        arity);
-                return EXIT_FAILURE;
-            }
-            func_cnt++;
-            if (!symbol)
-                break;
+    if (file == NULL)
+        return 0;
+    gethostname(host, sizeof(host) - 1);
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "%255s %d %d %d %255s %31s %d %d %d %d", line_host, &line_nodes,
+                    &line_width, &line_height, line_flags, engine_name, &line_cfg.sched,
+                    &line_cfg.chunk, &line_cfg.tile, &line_cfg.threads_cnt) != 10)
+            continue;
+        line_cfg.engine = find_engine(engine_name);
+        if (strcmp(line_host, host) == 0 && line_nodes == nodes && line_width == width
+                && line_height == height && strcmp(line_flags, flags) == 0
+                && line_cfg.engine >= 0) {
+            *cfg = line_cfg;
+            found = 1;
         }
-        grammar[master_pos].func_num = func_cnt;
     }
-
-
     fclose(file);
 
-    return EXIT_SUCCESS;
+    return found;
 }
 
-void fill_image_loop_parallel(unsigned char *img, int width, int height,
-        ExpressionNode *r_root, ExpressionNode *g_root, ExpressionNode *b_root,
-        int threads_cnt)
+void save_auto_config(AutoConfig *cfg, int nodes, int width, int height, char *flags)
 {
-#   pragma omp parallel for num_threads(threads_cnt) collapse(2)
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            int idx = (i * width + j) * 3;
-            double x_norm = (double)i / (double)height * 2 - 1;
-            double y_norm = (double)j / (double)width * 2 - 1;
-            img[idx + 0] = (evaluate_expression_tree(r_root, x_norm, y_norm, 0) + 1) / 2 * 255;
-            img[idx + 1] = (evaluate_expression_tree(g_root, x_norm, y_norm, 0) + 1) / 2 * 255;
-            img[idx + 2] = (evaluate_expression_tree(b_root, x_norm, y_norm, 0) + 1) / 2 * 255;
-        }
-    }
-}
+    char host[256] = "";
+    FILE *file = fopen(AUTO_CACHE_FILE, "a");
 
-void fill_image_rec_parallel(unsigned char *img, int width, int height,
-        ExpressionNode *r_root, ExpressionNode *g_root, ExpressionNode *b_root,
-        int threads_cnt)
-{
-#   pragma omp parallel num_threads(threads_cnt)
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            int idx = (i * width + j) * 3;
-            double x_norm = (double)i / (double)height * 2 - 1;
-            double y_norm = (double)j / (double)width * 2 - 1;
-#           pragma omp single
-            img[idx + 0] = (evaluate_expression_tree_parallel(r_root, x_norm, y_norm, 0) + 1) / 2 * 255;
-#           pragma omp single
-            img[idx + 1] = (evaluate_expression_tree_parallel(g_root, x_norm, y_norm, 0) + 1) / 2 * 255;
-#           pragma omp single
-            img[idx + 2] = (evaluate_expression_tree_parallel(b_root, x_norm, y_norm, 0) + 1) / 2 * 255;
-        }
+    if (file == NULL) {
+        fprintf(stderr, "Error opening file %s\n", AUTO_CACHE_FILE);
+        return;
     }
+    gethostname(host, sizeof(host) - 1);
+    fprintf(file, "%s %d %d %d %s %s %d %d %d %d\n", host, nodes, width, height, flags,
+            engine_names[cfg->engine], cfg->sched, cfg->chunk, cfg->tile, cfg->threads_cnt);
+    fclose(file);
 }
 
-
 /* functions in expressions */
 double add(double *nums)
 {
@@ -484,6 +4535,78 @@ double eight_sum(double *nums)
 }
 
 
+/*
+ * Approximations used with --fast-math. They are branch-free and call no
+ * library functions, so they vectorize inside omp simd loops. Rounding to
+ * the nearest integer uses the 1.5 * 2^52 trick, which is exact for the
+ * magnitudes that occur here.
+ */
+#define ROUND_MAGIC 6755399441055744.0
+
+/* sin(PI * a), max abs error 3.2e-7 */
+double fast_sin_pi(double a)
+{
+    /* Reduce to r in [-pi/4, pi/4] and the quadrant q */
+    double t = PI * a;
+    double q = (t * M_2_PI + ROUND_MAGIC) - ROUND_MAGIC;
+    double r = (t - q * 1.5707963267948966) - q * 6.123233995736766e-17;
+    double r2 = r * r;
+    double s = r + r * r2 * (-1.0 / 6 + r2 * (1.0 / 120 + r2 * (-1.0 / 5040)));
+    double c = 1 + r2 * (-0.5 + r2 * (1.0 / 24 + r2 * (-1.0 / 720 + r2 * (1.0 / 40320))));
+    long long qi = (long long)q;
+    double v = qi & 1 ? c : s;
+    return qi & 2 ? -v : v;
+}
+
+/* exp(v) for |v| <= 40, max relative error 1.7e-7 */
+double fast_exp(double v)
+{
+    double w = v * M_LOG2E;
+    double n = (w + ROUND_MAGIC) - ROUND_MAGIC;
+    double g = (w - n) * M_LN2;
+    double p = 1 + g * (1 + g * (1.0 / 2 + g * (1.0 / 6 + g * (1.0 / 24
+                        + g * (1.0 / 120 + g * (1.0 / 720))))));
+    union { long long bits; double d; } scale;
+    scale.bits = ((long long)n + 1023) << 52;
+    return p * scale.d;
+}
+
+/* 1 / (1 + exp(-tan(PI * a))) * 2 - 1, max abs error 2.2e-7 */
+double fast_tan_sigmoid(double a)
+{
+    double t = PI * a;
+    double q = (t * M_2_PI + ROUND_MAGIC) - ROUND_MAGIC;
+    double r = (t - q * 1.5707963267948966) - q * 6.123233995736766e-17;
+    double r2 = r * r;
+    double s = r + r * r2 * (-1.0 / 6 + r2 * (1.0 / 120 + r2 * (-1.0 / 5040)));
+    double c = 1 + r2 * (-0.5 + r2 * (1.0 / 24 + r2 * (-1.0 / 720 + r2 * (1.0 / 40320))));
+    double u = (long long)q & 1 ? -c / s : s / c;
+    /* The sigmoid is saturated far before exp() could overflow */
+    u = u > 40 ? 40 : u < -40 ? -40 : u;
+    return 2 / (1 + fast_exp(-u)) - 1;
+}
+
+double fast_sin_func(double *nums)
+{
+    return fast_sin_pi(nums[0]);
+}
+
+double fast_tan_func(double *nums)
+{
+    return fast_tan_sigmoid(nums[0]);
+}
+
+/* The function the compiled engines call for an opcode */
+Func kernel_func(int op)
+{
+    if (fast_math && op == OP_SIN)
+        return fast_sin_func;
+    if (fast_math && op == OP_TAN)
+        return fast_tan_func;
+    return func_collection[op].func;
+}
+
+
 int main(int argc, char **argv)
 {
     // Parse command line
@@ -493,19 +4616,51 @@ int main(int argc, char **argv)
     int flag_cmp = 0;
     int flag_print = 0;
     int flag_rec_parallel = 0;
+    int engine = ENGINE_TREE;
+    char *emit_c_file = NULL;
+    int flag_optimize = 1;
+    int threshold = ADAPTIVE_THRESHOLD;
+    char *dump_prefix = NULL;
+    int tile = 0;
+    int flag_steal = 0;
+    int flag_numa = 0;
+    int pin_mode = PIN_NONE;
+    int flag_auto = 0;
+    int layout = LAYOUT_DFS;
+    int flag_layout_bench = 0;
+    uint64_t seed = time(NULL);
+    char *seed_string = NULL;
+    struct option long_options[] = {
+        { "emit-c", required_argument, NULL, OPT_EMIT_C },
+        { "aot",    no_argument,       NULL, OPT_AOT },
+        { "no-opt", no_argument,       NULL, OPT_NO_OPT },
+        { "fast-math", no_argument,    NULL, OPT_FAST_MATH },
+        { "float",  no_argument,       NULL, OPT_FLOAT },
+        { "threshold", required_argument, NULL, OPT_THRESHOLD },
+        { "dump-passes", required_argument, NULL, OPT_DUMP_PASSES },
+        { "tile",   required_argument, NULL, OPT_TILE },
+        { "steal",  no_argument,       NULL, OPT_STEAL },
+        { "numa",   no_argument,       NULL, OPT_NUMA },
+        { "pin",    required_argument, NULL, OPT_PIN },
+        { "auto",   no_argument,       NULL, OPT_AUTO },
+        { "layout", required_argument, NULL, OPT_LAYOUT },
+        { "layout-bench", no_argument, NULL, OPT_LAYOUT_BENCH },
+        { "seed-string", required_argument, NULL, OPT_SEED_STRING },
+        { NULL,     0,                 NULL, 0 },
+    };
 
     // Ensure at least GRAMMAR_FILE is provided
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s GRAMMAR_FILE [-o OUTPUT_FILE] [-w WIDTH] [-h HEIGHT] [-t NUM_THREADS] [-d DEPTH] [-c] [-p] [-r]\n", argv[0]);
+        fprintf(stderr, USAGE, argv[0]);
         return 1;
     }
 
     // GRAMMAR_FILE is the first argument
     grammar_file = argv[1];
 
-    // Parse optional arguments using getopt
+    // Parse optional arguments using getopt_long
     int opt;
-    while ((opt = getopt(argc - 1, argv + 1, "o:w:h:t:d:cpr")) != -1) {
+    while ((opt = getopt_long(argc - 1, argv + 1, "o:w:h:t:d:e:s:cpr", long_options, NULL)) != -1) {
         switch (opt) {
         case 'o':
             output_file = optarg;
@@ -522,6 +4677,22 @@ int main(int argc, char **argv)
         case 'd':
             depth = atoi(optarg);
             break;
+        case 'e':
+            engine = find_engine(optarg);
+            if (engine < 0) {
+                fprintf(stderr, "Engine \"%s\" is not valid\n", optarg);
+                return 1;
+            }
+            break;
+        case 's': {
+            char *end;
+            seed = strtoull(optarg, &end, 0);
+            if (*optarg == '\0' || *end != '\0') {
+                fprintf(stderr, "Seed \"%s\" is not a number\n", optarg);
+                return 1;
+            }
+            break;
+        }
         case 'c':
             flag_cmp = 1;
             break;
@@ -531,13 +4702,90 @@ int main(int argc, char **argv)
         case 'r':
             flag_rec_parallel = 1;
             break;
+        case OPT_EMIT_C:
+            emit_c_file = optarg;
+            break;
+        case OPT_AOT:
+            engine = ENGINE_AOT;
+            break;
+        case OPT_NO_OPT:
+            flag_optimize = 0;
+            break;
+        case OPT_FAST_MATH:
+            fast_math = 1;
+            break;
+        case OPT_FLOAT:
+            use_float = 1;
+            break;
+        case OPT_THRESHOLD:
+            threshold = atoi(optarg);
+            break;
+        case OPT_DUMP_PASSES:
+            dump_prefix = optarg;
+            break;
+        case OPT_STEAL:
+            flag_steal = 1;
+            break;
+        case OPT_NUMA:
+            flag_numa = 1;
+            break;
+        case OPT_AUTO:
+            flag_auto = 1;
+            break;
+        case OPT_LAYOUT:
+            for (layout = LAYOUT_SCATTER; layout >= 0; layout--) {
+                if (strcmp(optarg, layout_names[layout]) == 0)
+                    break;
+            }
+            if (layout < 0 || layout == LAYOUT_SCATTER) {
+                fprintf(stderr, "Layout \"%s\" is not valid\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_LAYOUT_BENCH:
+            flag_layout_bench = 1;
+            break;
+        case OPT_SEED_STRING:
+            seed_string = optarg;
+            break;
+        case OPT_PIN:
+            if (strcmp(optarg, "compact") == 0)
+                pin_mode = PIN_COMPACT;
+            else if (strcmp(optarg, "scatter") == 0)
+                pin_mode = PIN_SCATTER;
+            else {
+                fprintf(stderr, "Pinning \"%s\" is not valid\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_TILE:
+            tile = atoi(optarg);
+            if (tile < 1) {
+                fprintf(stderr, "Tile size must be positive\n");
+                return 1;
+            }
+            break;
         default: // Invalid option
-            fprintf(stderr,
-                    "Usage: %s GRAMMAR_FILE [-o OUTPUT_FILE] [-w WIDTH] [-h HEIGHT] [-d DEPTH] [-t NUM_THREADS] [-c] [-p] [-r]\n",
-                    argv[0]);
+            fprintf(stderr, USAGE, argv[0]);
             return 1;
         }
     }
+    /* The pixel loops use schedule(runtime); static unless OMP_SCHEDULE says otherwise */
+    if (getenv("OMP_SCHEDULE") == NULL)
+        omp_set_schedule(omp_sched_static, 0);
+    if (flag_auto && flag_rec_parallel) {
+        fprintf(stderr, "--auto and -r cannot be combined\n");
+        return 1;
+    }
+    if (flag_steal && (width > STEAL_MAX_SIDE || height > STEAL_MAX_SIDE)) {
+        fprintf(stderr, "Work stealing supports images up to %d pixels per side\n", STEAL_MAX_SIDE);
+        return 1;
+    }
+    if (use_float && !flag_auto
+            && (flag_rec_parallel || (engine != ENGINE_BYTECODE && engine != ENGINE_SIMD))) {
+        fprintf(stderr, "--float is only supported by the bytecode and simd engines\n");
+        return 1;
+    }
 
     int exit_code;
     int entry_symbol_arr[3] = {0};
@@ -547,10 +4795,52 @@ int main(int argc, char **argv)
         return 1;
 
     unsigned char *img = (unsigned char*)malloc(sizeof(unsigned char) * height * width * 3);
-    srand(time(NULL));
-    ExpressionNode *r_root = build_expression_tree(grammar, entry_symbol_arr[0], depth);
-    ExpressionNode *g_root = build_expression_tree(grammar, entry_symbol_arr[1], depth);
-    ExpressionNode *b_root = build_expression_tree(grammar, entry_symbol_arr[2], depth);
+    Rng rng;
+    if (seed_string) {
+        seed_rng_string(&rng, seed_string);
+        printf("Seed is the SHA-256 of \"%s\"\n", seed_string);
+    } else {
+        seed_rng(&rng, seed);
+        printf("Seed is %llu\n", (unsigned long long)seed);
+    }
+    Arena arena;
+    int root_offsets[3];
+    double tbuild = omp_get_wtime();
+    build_expression_forest(&arena, grammar, entry_symbol_arr, depth, &rng, threads_cnt, root_offsets);
+    printf("Time taken for building the expression trees with %d threads is: %.4f\n",
+            threads_cnt, omp_get_wtime() - tbuild);
+    ExpressionNode *r_root = (ExpressionNode*)(arena.base + root_offsets[0]);
+    ExpressionNode *g_root = (ExpressionNode*)(arena.base + root_offsets[1]);
+    ExpressionNode *b_root = (ExpressionNode*)(arena.base + root_offsets[2]);
+    printf("Expression trees of %d nodes take %zu bytes in one arena\n",
+            count_expression_nodes(r_root) + count_expression_nodes(g_root)
+            + count_expression_nodes(b_root), arena.len);
+
+    if (flag_optimize) {
+        int nodes_before = count_expression_nodes(r_root) + count_expression_nodes(g_root)
+            + count_expression_nodes(b_root);
+        r_root = optimize_expression_tree(r_root);
+        g_root = optimize_expression_tree(g_root);
+        b_root = optimize_expression_tree(b_root);
+        printf("Optimization reduced the expression trees from %d to %d nodes\n", nodes_before,
+                count_expression_nodes(r_root) + count_expression_nodes(g_root)
+                + count_expression_nodes(b_root));
+    }
+
+    if (flag_layout_bench) {
+        ExpressionNode *roots[3] = { r_root, g_root, b_root };
+        benchmark_layouts(&arena, roots, width, height);
+    }
+    if (layout != LAYOUT_BUILD) {
+        Arena laid;
+        ExpressionNode *roots[3] = { r_root, g_root, b_root };
+        relayout_expression_trees(&laid, &arena, roots, layout);
+        free_arena(&arena);
+        arena = laid;
+        r_root = roots[0];
+        g_root = roots[1];
+        b_root = roots[2];
+    }
 
     if (flag_print) {
         printf("R channel:\n");
@@ -566,10 +4856,242 @@ int main(int argc, char **argv)
 
 
     double tstart, tstop, ttaken;
+    Program progs[3];
+    int need_dag = flag_rec_parallel || flag_auto
+        || (engine == ENGINE_DAG || engine == ENGINE_HOIST || engine == ENGINE_CULL
+                || engine == ENGINE_ADAPTIVE || engine == ENGINE_PROGRESSIVE
+                || engine == ENGINE_WAVEFRONT);
+    int need_progs = (!flag_rec_parallel && engine != ENGINE_TREE && !need_dag) || emit_c_file
+        || flag_auto;
+    if (need_progs) {
+        tstart = omp_get_wtime();
+        compile_expression_tree(r_root, &progs[0]);
+        compile_expression_tree(g_root, &progs[1]);
+        compile_expression_tree(b_root, &progs[2]);
+        tstop = omp_get_wtime();
+        printf("Compiled %d + %d + %d instructions (stack size %d, %d, %d)\n",
+                progs[0].len, progs[1].len, progs[2].len,
+                progs[0].stack_size, progs[1].stack_size, progs[2].stack_size);
+        printf("Time taken for compiling the expression trees is: %.4f\n", tstop - tstart);
+    }
+
+    Program fused = {0};
+    if (!flag_rec_parallel && (engine == ENGINE_FUSED || engine == ENGINE_TILED || flag_auto)) {
+        fuse_programs(progs, &fused);
+        if (engine == ENGINE_FUSED)
+            report_channel_cost(progs, width, height);
+    }
+
+    JitCode jit = {0};
+    if (!flag_rec_parallel && (engine == ENGINE_JIT || flag_auto)) {
+        tstart = omp_get_wtime();
+        exit_code = jit_compile(progs, &jit);
+        tstop = omp_get_wtime();
+        if (exit_code == EXIT_FAILURE && flag_auto) {
+            free_jit(&jit);
+        }
+        else if (exit_code == EXIT_FAILURE) {
+            fprintf(stderr, "JIT compilation is not available; falling back to the tree engine\n");
+            engine = ENGINE_TREE;
+        }
+        else {
+            printf("JIT emitted %zu bytes of machine code\n", jit.len);
+            printf("Time taken for JIT compiling the expression trees is: %.4f\n", tstop - tstart);
+        }
+    }
+
+    if (emit_c_file) {
+        FILE *file = fopen(emit_c_file, "w");
+        if (file == NULL) {
+            fprintf(stderr, "Error opening file %s\n", emit_c_file);
+            return 1;
+        }
+        emit_c_source(file, progs);
+        fclose(file);
+        printf("C source saved as %s\n", emit_c_file);
+    }
+
+    Dag dag = {0};
+    HoistPlan plan = {{0}};
+    WavefrontPlan wavefront = {0};
+    if (need_dag) {
+        ExpressionNode *roots[3] = { r_root, g_root, b_root };
+        int total = 0;
+        for (int c = 0; c < 3; c++)
+            total += count_expression_nodes(roots[c]);
+        tstart = omp_get_wtime();
+        build_dag(roots, &dag);
+        tstop = omp_get_wtime();
+        printf("Hash-consing removed %d of %d nodes (%d unique nodes left)\n",
+                total - dag.len, total, dag.len);
+        printf("Time taken for building the shared DAG is: %.4f\n", tstop - tstart);
+    }
+    if (flag_auto) {
+        ExpressionNode *roots[3] = { r_root, g_root, b_root };
+        int nodes = count_expression_nodes(r_root) + count_expression_nodes(g_root)
+            + count_expression_nodes(b_root);
+        AutoConfig best;
+        /* The options that change which engine is fastest, as one word */
+        char flags[256];
+        snprintf(flags, sizeof(flags), "fast-math=%d,float=%d,layout=%s,numa=%d,pin=%s",
+                fast_math, use_float, layout_names[layout], flag_numa,
+                pin_mode == PIN_COMPACT ? "compact" : pin_mode == PIN_SCATTER ? "scatter" : "none");
+        int cached = load_auto_config(&best, nodes, width, height, flags);
+
+        tstart = omp_get_wtime();
+        if (!cached) {
+            autotune(&best, width, height, roots, progs, &fused, &jit, &dag);
+            save_auto_config(&best, nodes, width, height, flags);
+        }
+        tstop = omp_get_wtime();
+        engine = best.engine;
+        tile = best.tile;
+        threads_cnt = best.threads_cnt;
+        omp_set_schedule(best.sched, best.chunk);
+        printf("Autotuner %s engine %s", cached ? "reused" : "picked", engine_names[engine]);
+        if (engine == ENGINE_TILED)
+            printf(" with %dx%d tiles", tile, tile);
+        else
+            printf(" with schedule %s and chunk %d", best.sched == omp_sched_dynamic ? "dynamic"
+                    : best.sched == omp_sched_guided ? "guided" : "static", best.chunk);
+        printf(" on %d threads\n", threads_cnt);
+        printf("Time taken for autotuning is: %.4f\n", tstop - tstart);
+    }
+    /* Only bytecode and simd get this far with --float, see above and autotune */
+    if (use_float)
+        report_float_drift(progs, width, height);
+
+    if (!flag_rec_parallel && engine == ENGINE_HOIST) {
+        build_hoist_plan(&dag, &plan);
+        printf("Hoisting: %d constant, %d x-only, %d y-only, %d mixed nodes"
+                " (%d + %d values cached per row/column)\n",
+                plan.nodes_len[DEP_CONST], plan.nodes_len[DEP_X], plan.nodes_len[DEP_Y],
+                plan.nodes_len[DEP_MIXED], plan.x_frontier_len, plan.y_frontier_len);
+    }
+    if (!flag_rec_parallel && engine == ENGINE_WAVEFRONT) {
+        long strip = (long)width * height < WAVEFRONT_STRIP ? (long)width * height : WAVEFRONT_STRIP;
+        build_wavefront_plan(&dag, &wavefront);
+        printf("Wavefront: %d levels, %d buffers for %d nodes, peak intermediate memory %.2f MiB"
+                " (%.2f MiB without reuse)\n", wavefront.levels, wavefront.slots_cnt, dag.len,
+                (double)wavefront.slots_cnt * strip * sizeof(double) / (1 << 20),
+                (double)dag.len * strip * sizeof(double) / (1 << 20));
+    }
+
+    AotCode aot = {0};
+    if (!flag_rec_parallel && engine == ENGINE_AOT) {
+        char src_file[] = "/tmp/rart-XXXXXX.c";
+        char *aot_src = emit_c_file;
+        if (!aot_src) {
+            int fd = mkstemps(src_file, 2);
+            FILE *file = fd < 0 ? NULL : fdopen(fd, "w");
+            if (file) {
+                emit_c_source(file, progs);
+                fclose(file);
+                aot_src = src_file;
+            }
+        }
+
+        tstart = omp_get_wtime();
+        exit_code = aot_src ? aot_compile(aot_src, &aot) : EXIT_FAILURE;
+        tstop = omp_get_wtime();
+        if (aot_src == src_file)
+            unlink(src_file);
+        if (exit_code == EXIT_FAILURE) {
+            fprintf(stderr, "AOT compilation failed; falling back to the tree engine\n");
+            engine = ENGINE_TREE;
+        }
+        else {
+            printf("Time taken for AOT compiling the expression trees is: %.4f\n", tstop - tstart);
+        }
+    }
+
+    /* Once --auto has fixed the engine, the schedule and the team */
+    if (pin_mode != PIN_NONE && !pin_threads(threads_cnt, pin_mode))
+        fprintf(stderr, "Thread pinning failed; threads are left unbound\n");
+    if (flag_numa) {
+        ExpressionNode *roots[3] = { r_root, g_root, b_root };
+        int shape = TOUCH_ROWS;
+        if (!flag_rec_parallel && (engine == ENGINE_TREE || engine == ENGINE_BYTECODE
+                    || engine == ENGINE_JIT || engine == ENGINE_DAG))
+            shape = TOUCH_PIXELS;
+        if (!flag_rec_parallel && (engine == ENGINE_SIMD || engine == ENGINE_FUSED))
+            shape = TOUCH_SEGMENTS;
+        init_numa_layout(threads_cnt);
+        first_touch_image(img, width, height, shape);
+        if (!flag_rec_parallel && engine == ENGINE_TREE)
+            replicate_trees(&arena, roots);
+        if (!flag_rec_parallel && (engine == ENGINE_BYTECODE || engine == ENGINE_SIMD))
+            replicate_programs(progs);
+        report_numa_layout();
+    }
+
+    StealPool pool = {0};
     tstart = omp_get_wtime();
     if (flag_rec_parallel) {
-        printf("Recursion parallel algorithm is chosen\n\n");
-        fill_image_rec_parallel(img, width, height, r_root, g_root, b_root, threads_cnt);
+        printf("Parallel tree contraction algorithm is chosen\n\n");
+        int batch;
+        int rounds = fill_image_contract(img, width, height, &dag, threads_cnt, &batch);
+        printf("Tree contraction took %d rounds per batch of %d pixels\n", rounds, batch);
+    }
+    else if (engine == ENGINE_BYTECODE) {
+        printf("Loop parallel algorithm with bytecode engine is chosen\n\n");
+        fill_image_bytecode(img, width, height, progs, threads_cnt);
+    }
+    else if (engine == ENGINE_SIMD) {
+        printf("Loop parallel algorithm with tile-batched SIMD engine is chosen\n\n");
+        fill_image_simd(img, width, height, progs, threads_cnt);
+    }
+    else if (engine == ENGINE_FUSED) {
+        printf("Loop parallel algorithm with fused three-channel engine is chosen\n\n");
+        fill_image_fused(img, width, height, &fused, threads_cnt);
+    }
+    else if (engine == ENGINE_TILED) {
+        if (tile == 0)
+            tile = choose_tile_size(&fused);
+        printf("Morton-ordered cache-blocked algorithm with %dx%d tiles is chosen\n\n", tile, tile);
+        fill_image_tiled(img, width, height, &fused, tile, threads_cnt, flag_steal ? &pool : NULL);
+    }
+    else if (engine == ENGINE_TASKS) {
+        printf("Task parallel algorithm over %dx%d tiles is chosen\n\n", TASK_TILE, TASK_TILE);
+        long tasks_cnt = fill_image_tasks(img, width, height, progs, threads_cnt);
+        printf("Spawned %ld subtree tasks\n", tasks_cnt);
+    }
+    else if (engine == ENGINE_JIT) {
+        printf("Loop parallel algorithm with JIT engine is chosen\n\n");
+        fill_image_jit(img, width, height, &jit, threads_cnt);
+    }
+    else if (engine == ENGINE_AOT) {
+        printf("Loop parallel algorithm with AOT compiled engine is chosen\n\n");
+        fill_image_aot(img, width, height, &aot, threads_cnt);
+    }
+    else if (engine == ENGINE_DAG) {
+        printf("Loop parallel algorithm with shared DAG engine is chosen\n\n");
+        fill_image_dag(img, width, height, &dag, threads_cnt);
+    }
+    else if (engine == ENGINE_WAVEFRONT) {
+        printf("Level-synchronous wavefront algorithm is chosen\n\n");
+        fill_image_wavefront(img, width, height, &dag, &wavefront, threads_cnt);
+    }
+    else if (engine == ENGINE_HOIST) {
+        printf("Loop parallel algorithm with axis-invariant hoisting is chosen\n\n");
+        fill_image_hoist(img, width, height, &dag, &plan, threads_cnt);
+    }
+    else if (engine == ENGINE_CULL) {
+        printf("Loop parallel algorithm with interval tile culling is chosen\n\n");
+        long skipped = fill_image_cull(img, width, height, &dag, threads_cnt, flag_steal ? &pool : NULL);
+        printf("Interval culling skipped %ld of %ld pixels (%.1f%%)\n", skipped,
+                (long)width * height, (double)skipped / ((long)width * height) * 100);
+    }
+    else if (engine == ENGINE_PROGRESSIVE) {
+        PassReport report = { tstart, dump_prefix };
+        printf("Progressive interlaced algorithm is chosen\n\n");
+        fill_image_progressive(img, width, height, &dag, threads_cnt, report_pass, &report);
+    }
+    else if (engine == ENGINE_ADAPTIVE) {
+        printf("Adaptive quadtree preview with threshold %d is chosen\n\n", threshold);
+        long sampled = fill_image_adaptive(img, width, height, &dag, threshold, threads_cnt);
+        printf("Adaptive rendering evaluated %ld of %ld pixels (%.1f%%)\n", sampled,
+                (long)width * height, (double)sampled / ((long)width * height) * 100);
     }
     else {
         printf("Loop parallel algorithm is chosen\n\n");
@@ -578,17 +5100,37 @@ int main(int argc, char **argv)
     tstop = omp_get_wtime();
     ttaken = tstop - tstart;
     printf("Time taken for generating the image with %d threads is: %.4f\n", threads_cnt, ttaken);
+    if (flag_numa)
+        report_numa_throughput();
+    if (pool.deques)
+        report_steal_stats(&pool);
 
     if (flag_cmp) {
         struct timespec tstart_1, tstop_1;
         double ttaken_1;
+        unsigned char *img_seq = (unsigned char*)malloc(sizeof(unsigned char) * height * width * 3);
         clock_gettime(CLOCK_MONOTONIC, &tstart_1);
-        fill_image_loop_parallel(img, width, height, r_root, g_root, b_root, 1);
+        fill_image_loop_parallel(img_seq, width, height, r_root, g_root, b_root, 1);
         clock_gettime(CLOCK_MONOTONIC, &tstop_1);
         ttaken_1 = (tstop_1.tv_sec - tstart_1.tv_sec) + 
             (tstop_1.tv_nsec - tstart_1.tv_nsec) / 1e9;
         printf("Time taken for generating the image sequentially is: %.4f\n", ttaken_1);
-        printf("Speedup: %.4f    Efficiency: %.4f\n\n", ttaken_1 / ttaken, ttaken_1 / ttaken / threads_cnt);
+        printf("Speedup: %.4f    Efficiency: %.4f\n", ttaken_1 / ttaken, ttaken_1 / ttaken / threads_cnt);
+
+        /* The sequential tree walk is the exact reference for every engine */
+        long diff_cnt = 0;
+        int diff_max = 0;
+        for (long k = 0; k < (long)height * width * 3; k++) {
+            int diff = abs(img[k] - img_seq[k]);
+            if (diff) {
+                diff_cnt++;
+                if (diff > diff_max)
+                    diff_max = diff;
+            }
+        }
+        printf("Output bytes differing from the sequential image: %ld of %ld (max difference %d)\n\n",
+                diff_cnt, (long)height * width * 3, diff_max);
+        free(img_seq);
 
         // if (stbi_write_png("comp.png", width, height, 3, img, 3 * width)) {
         //     printf("Image saved as comp.png\n");
@@ -606,9 +5148,19 @@ int main(int argc, char **argv)
     }
 
     free(img);
-    free_expression_tree(r_root);
-    free_expression_tree(g_root);
-    free_expression_tree(b_root);
+    free_program(&fused);
+    free_jit(&jit);
+    free_aot(&aot);
+    free_steal_pool(&pool);
+    free_numa_layout();
+    free_hoist_plan(&plan);
+    free_wavefront_plan(&wavefront);
+    free_dag(&dag);
+    if (need_progs) {
+        for (int c = 0; c < 3; c++)
+            free_program(&progs[c]);
+    }
+    free_arena(&arena);
 
     return 0;
 }